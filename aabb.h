@@ -13,24 +13,36 @@ class aabb {
 
         bool hit(const ray& r, double t_min, double t_max) const;
 
+        double surface_area() const {
+            auto d = maximum-minimum;
+            return 2*(d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+        }
+
+        int longest_axis() const {
+            auto d = maximum-minimum;
+            if (d.x() > d.y() && d.x() > d.z()) return 0;
+            return (d.y() > d.z())? 1:2;
+        }
+
     public:
         point3 minimum;
         point3 maximum;
 };
 
+// Branchless slab test: the ray's sign bits pick the near and far planes per axis, and
+// the comparisons are written so that NaNs (0*inf, ray in a slab plane) keep the old bound.
 inline bool aabb::hit(const ray& r, double t_min, double t_max) const {
+    const point3* bounds[2] = {&minimum, &maximum};
+    const auto& inv = r.inv_direction();
+    const auto& orig = r.orig;
+
     for (int a = 0; a < 3; a++) {
-        auto invD = 1.0f / r.direction()[a];
-        auto t0 = (min()[a] - r.origin()[a]) * invD;
-        auto t1 = (max()[a] - r.origin()[a]) * invD;
-        if (invD < 0.0f)
-            std::swap(t0, t1);
+        auto t0 = ((*bounds[r.sign[a]])[a] - orig[a]) * inv[a];
+        auto t1 = ((*bounds[1-r.sign[a]])[a] - orig[a]) * inv[a];
         t_min = t0 > t_min ? t0 : t_min;
         t_max = t1 < t_max ? t1 : t_max;
-        if (t_max <= t_min)
-            return false;
     }
-    return true;
+    return t_min < t_max;
 }
 
 aabb surrounding_box(aabb box0, aabb box1){
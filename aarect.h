@@ -12,13 +12,17 @@ class xy_rect: public hittable {
            x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat), area(fabs((_x1-_x0)*(_y1-_y0))) {};
 
         virtual bool hit(const ray& r, double _min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double t, x, y;
+            return intersect(r, t_min, t_max, t, x, y);
+        }
 
         virtual double pdf_value(const point3& origin, const vec3& v) const override {
-            hit_record rec;
-            if (!this->hit(ray(origin, v), 0.000001, infinity, rec)) return 0;
+            double t, a, b;
+            if (!intersect(ray(origin, v), ray_epsilon, infinity, t, a, b)) return 0;
 
-            auto distance_squared = rec.t*rec.t*v.length_squared();
-            auto cosine = fabs(dot(v, rec.normal) / v.length());
+            auto distance_squared = t*t*v.length_squared();
+            auto cosine = fabs(v[2] / v.length());
 
             return distance_squared/(cosine*area);
         }
@@ -26,17 +30,22 @@ class xy_rect: public hittable {
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have a non-zero width in each dimension, so pad the Z
             // dimension a small amount.
-            output_box = aabb(point3(x0, y0, k-0.000001), point3(x1, y1, k+0.000001));
+            output_box = aabb(point3(x0, y0, k-box_padding), point3(x1, y1, k+box_padding));
             return true;
         }
         virtual vec3 random(const point3& origin) const override {
             auto random_point = point3(random_double(x0, x1),random_double(y0, y1), k);
             return random_point-origin;
         }
+        virtual double surface_area() const override {return area;}
         
     public:
         double x0, x1, y0, y1, k;
         shared_ptr<material> mp;
+    private:
+        // Ray parameter and in-plane coordinates of the hit
+        bool intersect(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const;
+
     private:
         double area;
 };
@@ -50,20 +59,24 @@ class xz_rect : public hittable {
             : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat), area(fabs((_x1-_x0)*(_z1-_z0))) {};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double t, a, b;
+            return intersect(r, t_min, t_max, t, a, b);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
             // dimension a small amount.
-            output_box = aabb(point3(x0,k-0.000001,z0), point3(x1, k+0.000001, z1));
+            output_box = aabb(point3(x0,k-box_padding,z0), point3(x1, k+box_padding, z1));
             return true;
         }
 
         virtual double pdf_value(const point3& origin, const vec3& v) const override {
-            hit_record rec;
-            if (!this->hit(ray(origin, v), 0.000001, infinity, rec)) return 0;
+            double t, a, b;
+            if (!intersect(ray(origin, v), ray_epsilon, infinity, t, a, b)) return 0;
 
-            auto distance_squared = rec.t*rec.t*v.length_squared();
-            auto cosine = fabs(dot(v, rec.normal) / v.length());
+            auto distance_squared = t*t*v.length_squared();
+            auto cosine = fabs(v[1] / v.length());
 
             return distance_squared/(cosine*area);
         }
@@ -71,10 +84,15 @@ class xz_rect : public hittable {
             auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
             return random_point-origin;
         }
+        virtual double surface_area() const override {return area;}
 
     public:
         double x0, x1, z0, z1, k;
         shared_ptr<material> mp;
+    private:
+        // Ray parameter and in-plane coordinates of the hit
+        bool intersect(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const;
+
     private:
         double area;
 };
@@ -88,20 +106,24 @@ class yz_rect : public hittable {
             : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat), area(fabs((_y1-_y0)*(_z1-_z0))) {};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double t, a, b;
+            return intersect(r, t_min, t_max, t, a, b);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
             // dimension a small amount.
-            output_box = aabb(point3(k-0.000001, y0, z0), point3(k+0.000001, y1, z1));
+            output_box = aabb(point3(k-box_padding, y0, z0), point3(k+box_padding, y1, z1));
             return true;
         }
 
         virtual double pdf_value(const point3& origin, const vec3& v) const override {
-            hit_record rec;
-            if (!this->hit(ray(origin, v), 0.000001, infinity, rec)) return 0;
+            double t, a, b;
+            if (!intersect(ray(origin, v), ray_epsilon, infinity, t, a, b)) return 0;
 
-            auto distance_squared = rec.t*rec.t*v.length_squared();
-            auto cosine = fabs(dot(v, rec.normal) / v.length());
+            auto distance_squared = t*t*v.length_squared();
+            auto cosine = fabs(v[0] / v.length());
 
             return distance_squared/(cosine*area);
         }
@@ -109,64 +131,81 @@ class yz_rect : public hittable {
             auto random_point = point3(k, random_double(y0, y1), random_double(z0, z1));
             return random_point-origin;
         }
+        virtual double surface_area() const override {return area;}
 
     public:
         double y0, y1, z0, z1, k;
         shared_ptr<material> mp;
+    private:
+        // Ray parameter and in-plane coordinates of the hit
+        bool intersect(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const;
+
     private:
         double area;
 };
 
-bool xy_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    auto t = (k-r.origin().z())/r.direction().z();
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, double& t, double& x, double& y) const {
+    t = (k-r.origin().z())/r.direction().z();
     if (t < t_min || t > t_max) return false;
 
-    auto x = r.origin().x() + t*r.direction().x();
-    auto y = r.origin().y() + t*r.direction().y();
-    if (x < x0 || x > x1 || y < y0 || y > y1)
-        return false;
+    x = r.origin().x() + t*r.direction().x();
+    y = r.origin().y() + t*r.direction().y();
+    return !(x < x0 || x > x1 || y < y0 || y > y1);
+}
+
+bool xy_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    double t, x, y;
+    if (!intersect(r, t_min, t_max, t, x, y)) return false;
     rec.u = (x-x0)/(x1-x0);
     rec.v = (y-y0)/(y1-y0);
     rec.t = t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto t = (k-r.origin().y()) / r.direction().y();
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, double& t, double& x, double& z) const {
+    t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
-    auto x = r.origin().x() + t*r.direction().x();
-    auto z = r.origin().z() + t*r.direction().z();
-    if (x < x0 || x > x1 || z < z0 || z > z1)
-        return false;
+    x = r.origin().x() + t*r.direction().x();
+    z = r.origin().z() + t*r.direction().z();
+    return !(x < x0 || x > x1 || z < z0 || z > z1);
+}
+
+bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, x, z;
+    if (!intersect(r, t_min, t_max, t, x, z)) return false;
     rec.u = (x-x0)/(x1-x0);
     rec.v = (z-z0)/(z1-z0);
     rec.t = t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto t = (k-r.origin().x()) / r.direction().x();
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, double& t, double& y, double& z) const {
+    t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
-    auto y = r.origin().y() + t*r.direction().y();
-    auto z = r.origin().z() + t*r.direction().z();
-    if (y < y0 || y > y1 || z < z0 || z > z1)
-        return false;
+    y = r.origin().y() + t*r.direction().y();
+    z = r.origin().z() + t*r.direction().z();
+    return !(y < y0 || y > y1 || z < z0 || z > z1);
+}
+
+bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, y, z;
+    if (!intersect(r, t_min, t_max, t, y, z)) return false;
     rec.u = (y-y0)/(y1-y0);
     rec.v = (z-z0)/(z1-z0);
     rec.t = t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
@@ -0,0 +1,68 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+#include "rtweekend.h"
+
+#include <vector>
+
+// Per-pixel convergence test for adaptive sampling. Samples are taken in batches;
+// once a pixel has min_spp samples it stops as soon as the standard error of its
+// mean luminance drops below max_relative_error times that mean. Flat background
+// converges after the first batch, caustics and glass keep going up to the cap.
+// Samples a converged pixel doesn't take are not handed to other pixels, the render
+// just finishes sooner.
+
+// Samples per batch. A batch draws 2 jitter values per sample, which has to be a whole
+// number of the batch generator's 4 lanes: random_doubles() throws away the rest of a
+// partly used step, so only then do batches give the same numbers as a whole-pixel fill.
+const int adaptive_batch_size = 16;
+static_assert((2*adaptive_batch_size) % xoshiro256p_x4::lanes == 0,
+        "a batch's jitter must fill whole steps of the 4-lane generator");
+
+// Darker pixels than this are judged by their absolute error, or a black pixel
+// with a single stray bright sample would never converge
+const double adaptive_min_mean = 1e-3;
+
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+}
+
+// Running mean and variance of a pixel's sample luminance (Welford's algorithm)
+struct pixel_estimate {
+    int n = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    void add(const color& sample) {
+        double x = luminance(sample);
+        n++;
+        double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    double variance() const {return n > 1? m2/(n-1) : infinity;}
+
+    // Standard error of the mean, relative to the mean
+    double relative_error() const {
+        if (n < 2) return infinity;
+        return sqrt(variance()/n) / fmax(mean, adaptive_min_mean);
+    }
+
+    bool converged(int min_spp, double max_relative_error) const {
+        return n >= min_spp && relative_error() <= max_relative_error;
+    }
+};
+
+// Debug image of the samples spent per pixel, scaled so that max_spp is white.
+// counts and the result are in the render loop's bottom-up row order.
+inline std::vector<color> samples_image(const std::vector<int>& counts, int max_spp) {
+    std::vector<color> out(counts.size());
+    for (size_t i = 0; i < counts.size(); i++) {
+        double v = static_cast<double>(counts[i]) / max_spp;
+        out[i] = color(v, v, v);
+    }
+    return out;
+}
+
+#endif
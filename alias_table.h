@@ -0,0 +1,82 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <vector>
+
+// Walker's alias method, built with Vose's algorithm: after an O(n) setup, drawing an
+// index with probability proportional to its weight takes one random number, one
+// table lookup and a compare. Every bin holds the probability of keeping its own index
+// and the index to switch to otherwise.
+class alias_table {
+    public:
+        alias_table() {}
+        // Weights must be >= 0; if they are all 0 every index is equally likely
+        alias_table(const std::vector<double>& weights);
+
+        size_t size() const {return bins.size();}
+        bool empty() const {return bins.empty();}
+
+        // Probability of drawing index i
+        double pmf(size_t i) const {return probabilities[i];}
+
+        // u in [0, 1)
+        size_t sample(double u) const {
+            const double scaled = u*static_cast<double>(bins.size());
+            size_t i = static_cast<size_t>(scaled);
+            if (i >= bins.size()) i = bins.size()-1;
+            const auto& b = bins[i];
+            return (scaled - static_cast<double>(i)) < b.keep? i : b.alias;
+        }
+
+        size_t sample() const {return sample(random_double());}
+
+    private:
+        struct bin {
+            float keep;
+            uint32_t alias;
+        };
+
+        std::vector<bin> bins;
+        std::vector<float> probabilities;
+};
+
+alias_table::alias_table(const std::vector<double>& weights) {
+    const size_t n = weights.size();
+    if (n == 0) return;
+    bins.resize(n);
+    probabilities.resize(n);
+
+    double sum = 0;
+    for (auto w : weights) sum += w;
+
+    // Weights scaled so that the average bin is 1, split into under- and overfull bins
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        const double p = sum > 0? weights[i]/sum : 1.0/static_cast<double>(n);
+        probabilities[i] = static_cast<float>(p);
+        scaled[i] = p*static_cast<double>(n);
+        (scaled[i] < 1? small : large).push_back(static_cast<uint32_t>(i));
+    }
+
+    // Every underfull bin is topped up from an overfull one, which may become underfull itself
+    while (!small.empty() && !large.empty()) {
+        const uint32_t s = small.back(); small.pop_back();
+        const uint32_t l = large.back();
+        bins[s] = {static_cast<float>(scaled[s]), l};
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // What's left is 1 up to rounding
+    for (auto i : large) bins[i] = {1.0f, i};
+    for (auto i : small) bins[i] = {1.0f, i};
+}
+
+#endif
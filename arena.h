@@ -0,0 +1,128 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "rtweekend.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Memory arena for everything a scene builder creates. Objects are still handed out as
+// shared_ptrs, but through std::allocate_shared, so object and control block are one
+// allocation, bump allocated from a pool of their own type: all spheres end up next to
+// each other, all lambertians, ... instead of scattered over the heap. Nothing is freed
+// one by one, the pools go away with the arena.
+//
+// Every control block keeps the arena alive (its allocator holds a shared_ptr to it), so
+// an object that outlives the scene is still fine.
+//
+// make_pooled<T>() allocates from the arena of the innermost scene_arena::scope, or is
+// plain make_shared<T>() outside of one.
+class scene_arena {
+    public:
+        scene_arena() {}
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        void* allocate(const std::type_info& type, size_t bytes, size_t alignment);
+
+        size_t object_count() const {return objects;}
+        size_t bytes_used() const {return used;}
+        size_t bytes_reserved() const {return reserved;}
+        size_t pool_count() const {return pools.size();}
+
+        // Makes arena the one make_pooled allocates from, until the scope ends
+        class scope {
+            public:
+                scope(const shared_ptr<scene_arena>& arena): previous(current()) {current() = arena;}
+                ~scope() {current() = previous;}
+                scope(const scope&) = delete;
+                scope& operator=(const scope&) = delete;
+            private:
+                shared_ptr<scene_arena> previous;
+        };
+
+        static shared_ptr<scene_arena>& current() {
+            static shared_ptr<scene_arena> arena;
+            return arena;
+        }
+
+    private:
+        struct pool {
+            std::vector<std::unique_ptr<unsigned char[]>> blocks;
+            unsigned char* next = nullptr;
+            size_t left = 0;
+            size_t block_size = first_block_size;
+        };
+
+        // Blocks of a pool double in size up to the largest one
+        static const size_t first_block_size = size_t(16) << 10;
+        static const size_t max_block_size = size_t(1) << 20;
+
+        std::mutex lock;
+        std::unordered_map<std::type_index, pool> pools;
+        size_t objects = 0, used = 0, reserved = 0;
+};
+
+void* scene_arena::allocate(const std::type_info& type, size_t bytes, size_t alignment) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto& p = pools[std::type_index(type)];
+
+    auto padding = [&]() {
+        return (alignment - reinterpret_cast<uintptr_t>(p.next) % alignment) % alignment;
+    };
+    if (!p.next || padding() + bytes > p.left) {
+        // Oversized objects get a block to themselves
+        const size_t size = std::max(p.block_size, bytes + alignment);
+        p.blocks.emplace_back(new unsigned char[size]);
+        p.next = p.blocks.back().get();
+        p.left = size;
+        reserved += size;
+        p.block_size = std::min(2*p.block_size, max_block_size);
+    }
+
+    const size_t pad = padding();
+    void* out = p.next + pad;
+    p.next += pad + bytes;
+    p.left -= pad + bytes;
+    objects++;
+    used += bytes;
+    return out;
+}
+
+template <typename T>
+struct arena_allocator {
+    using value_type = T;
+
+    arena_allocator(shared_ptr<scene_arena> _arena): arena(std::move(_arena)) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other): arena(other.arena) {}
+
+    // allocate_shared rebinds this to its control block type, so that's the pool key
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(typeid(T), n*sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    shared_ptr<scene_arena> arena;
+};
+
+template <typename T, typename U>
+bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) {return a.arena == b.arena;}
+template <typename T, typename U>
+bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) {return a.arena != b.arena;}
+
+template <typename T, typename... Args>
+shared_ptr<T> make_pooled(Args&&... args) {
+    const auto& arena = scene_arena::current();
+    if (!arena) return make_shared<T>(std::forward<Args>(args)...);
+    return std::allocate_shared<T>(arena_allocator<T>(arena), std::forward<Args>(args)...);
+}
+
+#endif
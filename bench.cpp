@@ -0,0 +1,379 @@
+// Benchmark suite: renders a fixed set of scenes at a fixed seed, size and spp with a
+// few thread counts and prints the results as JSON, so two builds can be compared.
+//
+//     riow_bench [--scenes 1,6,8,9] [--width 320] [--spp 16] [--threads 1,2,4]
+//                [--integrator recursive] [--skybox <path>] [--output bench.json]
+//
+// Per scene and thread count it reports the render time, samples/s and Mrays/s (every
+// ray traced against the world, camera and bounce rays alike) and the speedup over the
+// smallest thread count. image_hash is a hash of the rendered pixels: it only changes
+// when the image does, whatever the thread count. Scenes lit by the HDR skybox get a
+// constant background unless --skybox is given, so the suite runs without the assets.
+// The BVH build is timed separately on a fixed set of random spheres. Pixels are sampled
+// by the same pixel_sampler as riow, with riow's integrator defaults unless overridden.
+//
+// Timings are only meaningful without sanitizers: RTW_ASAN leaves this target out and it
+// refuses to build with them. process_peak_rss_mb is the high-water mark of the whole run.
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "pdf.h"
+#include "texture.h"
+#include "integrator.h"
+#include "light_sampler.h"
+#include "adaptive_sampling.h"
+#include "tile_scheduler.h"
+#include "scenes.h"
+#include "render_options.h"
+#include "bvh4.h"
+#include "sphere.h"
+#include "pixel_sampler.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#error "riow_bench measures throughput and memory, build it without -fsanitize=address"
+#endif
+
+struct bench_options {
+    std::vector<std::string> scenes = {"rt_iow_final_scene", "cornell_box", "rt_tnw_final_scene", "triangle_test"};
+    int image_width = 320;
+    int samples_per_pixel = 16;
+    std::vector<int> threads;
+    uint64_t seed = 1;
+    size_t bvh_primitives = 200000;
+    std::string skybox_path;
+    std::string output_path = "-";
+    // Integrator, depths and light sampling as riow would use them
+    render_options render;
+};
+
+void print_bench_usage(const char* program) {
+    std::cerr <<
+        "Usage: " << program << " [options]\n"
+        "  --scenes <a,b,...>     scenes to render, names or ids (default 1,6,8,9)\n"
+        "  --width <px>           image width (default 320)\n"
+        "  --spp <n>              samples per pixel (default 16)\n"
+        "  --threads <a,b,...>    thread counts to run every scene with\n"
+        "                         (default 1, 2, 4, ... up to the number of cores)\n"
+        "  --seed <n>             render seed (default 1)\n"
+        "  --integrator <name>, --depth <n>, --max-depth-iterative <n>, --rr-depth <n>,\n"
+        "  --light-sampling <mode>\n"
+        "                         as for riow, with the same defaults (no wavefront)\n"
+        "  --bvh-primitives <n>   spheres in the BVH build benchmark (default 200000)\n"
+        "  --skybox <path>        HDR environment map for skybox scenes (default: constant background)\n"
+        "  --output <path>        JSON output, - for stdout (default -)\n";
+}
+
+inline std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> out;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty()) out.push_back(item);
+    return out;
+}
+
+bool parse_bench_command_line(int argc, char** argv, bench_options& opts) {
+    for (int a = 1; a < argc; a++) {
+        std::string key = argv[a];
+        if (key == "--help" || key == "-h") {
+            print_bench_usage(argv[0]);
+            exit(0);
+        }
+        if (key.compare(0, 2, "--") != 0 || a+1 >= argc) {
+            std::cerr << "ERROR: Expected '--option value', got '" << key << "'.\n";
+            print_bench_usage(argv[0]);
+            return false;
+        }
+        key = key.substr(2);
+        for (auto& c : key) if (c == '-') c = '_';
+        const std::string value = argv[++a];
+
+        bool ok = true;
+        if (key == "scenes") opts.scenes = split_list(value);
+        else if (key == "width") ok = parse_value(value, opts.image_width) && opts.image_width > 0;
+        else if (key == "spp") ok = parse_value(value, opts.samples_per_pixel) && opts.samples_per_pixel > 0;
+        else if (key == "seed") ok = parse_value(value, opts.seed);
+        else if (key == "skybox") opts.skybox_path = value;
+        else if (key == "output") opts.output_path = value;
+        else if (key == "integrator" || key == "depth" || key == "max_depth_iterative"
+                || key == "rr_depth" || key == "light_sampling") {
+            if (!set_option(opts.render, key, value)) return false;
+            // Wavefront renders whole waves, not pixels, so it has no per-pixel loop to time here
+            ok = opts.render.integrator != integrator_type::wavefront;
+        }
+        else if (key == "bvh_primitives") {
+            int n;
+            ok = parse_value(value, n) && n > 0;
+            if (ok) opts.bvh_primitives = static_cast<size_t>(n);
+        }
+        else if (key == "threads") {
+            opts.threads.clear();
+            for (const auto& item : split_list(value)) {
+                int n;
+                if (!parse_value(item, n) || n <= 0) ok = false;
+                else opts.threads.push_back(n);
+            }
+            ok = ok && !opts.threads.empty();
+        }
+        else {
+            std::cerr << "ERROR: Unknown option '" << key << "'.\n";
+            return false;
+        }
+        if (!ok) {
+            std::cerr << "ERROR: Invalid value '" << value << "' for option '" << key << "'.\n";
+            return false;
+        }
+    }
+
+    if (opts.threads.empty()) {
+        const int cores = omp_get_max_threads();
+        for (int n = 1; n < cores; n *= 2) opts.threads.push_back(n);
+        opts.threads.push_back(cores);
+    }
+    return true;
+}
+
+// Counts the rays traced against the world, per thread so counting costs no atomics
+thread_local uint64_t rays_traced = 0;
+
+class ray_counter: public hittable {
+    public:
+        ray_counter(const hittable& _inner): inner(_inner) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            rays_traced++;
+            return inner.hit(r, t_min, t_max, rec);
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            rays_traced++;
+            return inner.occluded(r, t_min, t_max);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return inner.bounding_box(time0, time1, output_box);
+        }
+
+    public:
+        const hittable& inner;
+};
+
+inline double peak_rss_mb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_maxrss) / 1024.0;   // kB on Linux
+}
+
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+struct render_result {
+    int threads;
+    double seconds;
+    uint64_t rays;
+    uint64_t image_hash;
+};
+
+// The same samples as riow with the same seed, width, spp and integrator options (in a single pass).
+// image_height is the one image_height_for() checked.
+render_result render_scene(const scene_config& scene, const hittable& world, const shared_ptr<hittable>& lights,
+        const shared_ptr<texture>& background, const shared_ptr<pdf>& background_pdf,
+        const bench_options& opts, int image_height, int threads) {
+    const int image_width = opts.image_width;
+    const int samples_per_pixel = opts.samples_per_pixel;
+    camera cam(scene.lookfrom, scene.lookat, scene.vup, scene.vfov, scene.aspect_ratio,
+            scene.aperture, scene.focus_dist, 0.0, 1.0);
+    const ray_counter counted_world(world);
+    const render_options& render = opts.render;
+    const pixel_sampler sampler{cam, image_width, image_height, background, background_pdf, counted_world, lights,
+            render.integrator, render.max_depth, render.max_depth_iterative, render.rr_min_depth};
+
+    std::vector<color> pixels(static_cast<size_t>(image_width)*image_height);
+    tile_scheduler scheduler(image_width, image_height, render.tile_size, threads);
+    uint64_t rays = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    #pragma omp parallel num_threads(threads) reduction(+:rays)
+    {
+    const uint64_t rays_before = rays_traced;
+    std::vector<double> jitter(2*adaptive_batch_size);
+    const int worker = omp_get_thread_num();
+    tile t;
+    while (scheduler.next_tile(worker, t)) {
+        for (int j = t.y0; j < t.y1; ++j) {
+            for (int i = t.x0; i < t.x1; ++i) {
+                pixel_estimate estimate;
+                const color pixel_color = sampler.sample(i, j, opts.seed, 0, samples_per_pixel,
+                        estimate, samples_per_pixel, 0, jitter);
+                pixels[static_cast<size_t>(j)*image_width+i] = pixel_color / samples_per_pixel;
+            }
+        }
+        scheduler.finish_tile();
+    }
+    rays += rays_traced - rays_before;
+    }
+    const double seconds = seconds_since(start);
+
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    for (const auto& p : pixels) {
+        for (int c = 0; c < 3; c++) {
+            double value = p[c];
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            hash = rotl64(hash ^ bits, 29) * 0xbf58476d1ce4e5b9ULL;
+        }
+    }
+    return {threads, seconds, rays, splitmix64(hash)};
+}
+
+struct bvh_result {
+    int threads;
+    double seconds;
+};
+
+int main(int argc, char** argv) {
+    bench_options opts;
+    if (!parse_bench_command_line(argc, argv, opts)) return 1;
+
+    std::ostringstream json;
+    json.precision(6);
+    json << "{\n";
+    json << "  \"width\": " << opts.image_width << ",\n"
+         << "  \"spp\": " << opts.samples_per_pixel << ",\n"
+         << "  \"seed\": " << opts.seed << ",\n"
+         << "  \"integrator\": \"" << integrator_name(opts.render.integrator) << "\",\n"
+         << "  \"scenes\": [";
+
+    bool first_scene = true;
+    for (const auto& name : opts.scenes) {
+        const auto entry = find_scene(name);
+        if (!entry) {
+            std::cerr << "ERROR: Unknown scene '" << name << "'.\n";
+            return 1;
+        }
+        std::cerr << "Scene " << entry->name << "\n";
+
+        // Scene builders make their own BVHs (and load models), so this includes those
+        const auto setup_start = std::chrono::steady_clock::now();
+        scene_config scene;
+        if (!load_scene(name, scene)) return 1;
+        const double setup_seconds = seconds_since(setup_start);
+
+        shared_ptr<texture> background;
+        shared_ptr<pdf> background_pdf;
+        const bool skybox = scene.use_skybox && !opts.skybox_path.empty();
+        if (skybox) {
+            auto background_skybox = make_shared<image_texture>(opts.skybox_path.c_str());
+            background = background_skybox;
+            background_pdf = make_shared<image_pdf>(background_skybox);
+        } else {
+            background = make_shared<solid_color>(scene.use_skybox? color(0.7, 0.8, 1.0) : scene.background_color);
+            background_pdf = make_shared<sphere_pdf>();
+        }
+
+        auto light_list = std::dynamic_pointer_cast<hittable_list>(scene.lights);
+        if (!light_list) light_list = make_shared<hittable_list>(scene.lights);
+        const shared_ptr<hittable> lights = make_shared<light_sampler>(*light_list, opts.render.light_mode, scene.light_powers);
+
+        int image_height;
+        if (!image_height_for(opts.image_width, scene.aspect_ratio, image_height)) return 1;
+
+        std::vector<render_result> results;
+        for (int threads : opts.threads) {
+            results.push_back(render_scene(scene, scene.world, lights, background, background_pdf, opts, image_height, threads));
+            const auto& r = results.back();
+            std::cerr << "  " << threads << " threads: " << r.seconds << " s, "
+                      << static_cast<double>(r.rays)/r.seconds*1e-6 << " Mrays/s\n";
+        }
+
+        const double samples = static_cast<double>(opts.image_width)*image_height*opts.samples_per_pixel;
+        char hash_text[17];
+        snprintf(hash_text, sizeof(hash_text), "%016llx", static_cast<unsigned long long>(results[0].image_hash));
+        bool hashes_match = true;
+        for (const auto& r : results) hashes_match = hashes_match && r.image_hash == results[0].image_hash;
+
+        json << (first_scene? "\n" : ",\n")
+             << "    {\n"
+             << "      \"name\": \"" << entry->name << "\",\n"
+             << "      \"height\": " << image_height << ",\n"
+             << "      \"background\": \"" << (skybox? "skybox" : "constant") << "\",\n"
+             << "      \"setup_seconds\": " << setup_seconds << ",\n"
+             << "      \"image_hash\": \"" << hash_text << "\",\n"
+             << "      \"deterministic\": " << (hashes_match? "true" : "false") << ",\n"
+             << "      \"runs\": [";
+        for (size_t k = 0; k < results.size(); k++) {
+            const auto& r = results[k];
+            json << (k == 0? "\n" : ",\n")
+                 << "        {\"threads\": " << r.threads
+                 << ", \"seconds\": " << r.seconds
+                 << ", \"rays\": " << r.rays
+                 << ", \"mrays_per_second\": " << static_cast<double>(r.rays)/r.seconds*1e-6
+                 << ", \"samples_per_second\": " << samples/r.seconds
+                 << ", \"speedup\": " << results[0].seconds/r.seconds << "}";
+        }
+        json << "\n      ]\n    }";
+        first_scene = false;
+    }
+    json << "\n  ],\n";
+
+    // BVH build over a fixed cloud of spheres, with the same thread counts
+    std::cerr << "BVH build, " << opts.bvh_primitives << " spheres\n";
+    std::vector<shared_ptr<hittable>> spheres;
+    seed_random(hash_seed(opts.seed, 0xb7));
+    auto dummy = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (size_t i = 0; i < opts.bvh_primitives; i++) {
+        point3 center(random_double(-100, 100), random_double(-100, 100), random_double(-100, 100));
+        spheres.push_back(make_shared<sphere>(center, random_double(0.05, 0.5), dummy));
+    }
+
+    std::vector<bvh_result> builds;
+    bvh_build_stats stats;
+    for (int threads : opts.threads) {
+        omp_set_num_threads(threads);
+        const auto start = std::chrono::steady_clock::now();
+        bvh4 tree(spheres, 0, 1);
+        builds.push_back({threads, seconds_since(start)});
+        stats = tree.build_stats;
+        std::cerr << "  " << threads << " threads: " << builds.back().seconds << " s\n";
+    }
+
+    json << "  \"bvh_build\": {\n"
+         << "    \"primitives\": " << opts.bvh_primitives << ",\n"
+         << "    \"nodes\": " << stats.node_count << ",\n"
+         << "    \"sah_cost\": " << stats.sah_cost << ",\n"
+         << "    \"runs\": [";
+    for (size_t k = 0; k < builds.size(); k++) {
+        json << (k == 0? "\n" : ",\n")
+             << "      {\"threads\": " << builds[k].threads
+             << ", \"seconds\": " << builds[k].seconds
+             << ", \"speedup\": " << builds[0].seconds/builds[k].seconds << "}";
+    }
+    json << "\n    ]\n  },\n"
+         << "  \"process_peak_rss_mb\": " << peak_rss_mb() << "\n"
+         << "}\n";
+
+    if (opts.output_path == "-") {
+        std::cout << json.str();
+    } else {
+        std::ofstream out(opts.output_path);
+        if (!(out << json.str())) {
+            std::cerr << "ERROR: Couldn't write '" << opts.output_path << "'.\n";
+            return 1;
+        }
+    }
+    return 0;
+}
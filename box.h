@@ -2,6 +2,7 @@
 #define BOX_H
 
 #include "rtweekend.h"
+#include "arena.h"
 
 #include "aarect.h"
 #include "hittable_list.h"
@@ -12,6 +13,10 @@ class box: public hittable {
         box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return sides.occluded(r, t_min, t_max);
+        }
+        virtual double surface_area() const override {return sides.surface_area();}
         
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
@@ -26,14 +31,14 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr){
     box_min = p0;
     box_max = p1;
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    sides.add(make_pooled<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
+    sides.add(make_pooled<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    sides.add(make_pooled<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
+    sides.add(make_pooled<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    sides.add(make_pooled<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
+    sides.add(make_pooled<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
 bool box::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
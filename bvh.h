@@ -8,11 +8,320 @@
 #include "hittable.h"
 #include "hittable_list.h"
 
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+// Per-primitive data the builder needs, computed once up front instead of
+// calling bounding_box() at every level of the recursion.
+struct bvh_primitive_info {
+    size_t index;
+    aabb box;
+    point3 centroid;
+};
+
+// Node of the intermediate tree the builder produces, children are indices
+// into bvh_builder::nodes. Leaves reference the range [first, first+count) of
+// the (reordered) bvh_builder::prims.
+struct bvh_build_node {
+    aabb box;
+    int left = -1, right = -1;
+    size_t first = 0, count = 0;
+    int axis = 0;
+
+    bool is_leaf() const {return left < 0;}
+};
+
+struct bvh_build_stats {
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    int max_depth = 0;
+    double sah_cost = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const bvh_build_stats& stats) {
+    return out << stats.node_count << " nodes, " << stats.leaf_count << " leaves, depth "
+               << stats.max_depth << ", SAH cost " << stats.sah_cost;
+}
+
+// Binned surface area heuristic builder, see
+// https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+// Primitive records are partitioned in place, so nothing is copied per level.
+//
+// Large builds run in parallel with OpenMP tasks: the two halves of a split touch
+// disjoint ranges of prims, so subtrees above parallel_grain primitives are built as
+// separate tasks, and the bounds and binning passes over big ranges are split into
+// chunks. Nodes are preallocated (a binary tree over n primitives has at most 2n-1)
+// and handed out by an atomic counter. Every split only depends on the contents of
+// its own range, so the tree is the same as a serial build, only numbered differently.
+class bvh_builder {
+    public:
+        static const int n_bins = 12;
+        // Relative costs of one node traversal and one primitive intersection.
+        constexpr static double traversal_cost = 0.125;
+        constexpr static double intersection_cost = 1.0;
+        // Below this depth ranges are split at the object median, which bounds
+        // the total depth (and so the traversal stack) for badly behaved input.
+        static const int max_sah_depth = 48;
+        // Ranges smaller than this are built serially
+        static const size_t parallel_grain = 4096;
+        // Ranges larger than this have their bounds and bins computed by several tasks
+        static const size_t parallel_scan_size = 1 << 16;
+        static const int scan_chunks = 16;
+
+        bvh_builder(const std::vector<shared_ptr<hittable>>& objects,
+                size_t start, size_t end, double time0, double time1, size_t _max_leaf_size);
+        // For primitives that aren't hittables (mesh faces, ...), index is up to the caller
+        bvh_builder(std::vector<bvh_primitive_info> _prims, size_t _max_leaf_size);
+
+    public:
+        size_t max_leaf_size;
+        std::vector<bvh_primitive_info> prims;
+        std::vector<bvh_build_node> nodes;
+        bvh_build_stats stats;
+
+    private:
+        int allocate_node() {return next_node++;}
+        void build(int node_index, size_t start, size_t end, int depth);
+        size_t find_split(size_t start, size_t end, int depth, const aabb& bounds, int& axis);
+        template <typename chunk_fn>
+        void for_chunks(size_t start, size_t end, chunk_fn&& body);
+        template <typename box_fn>
+        aabb range_bounds(size_t start, size_t end, box_fn&& box_of);
+        void compute_stats(int node_index, int depth);
+
+    private:
+        std::atomic<int> next_node{0};
+};
+
+inline aabb empty_box() {
+    return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+}
+
+inline std::vector<bvh_primitive_info> primitive_infos(const std::vector<shared_ptr<hittable>>& objects,
+        size_t start, size_t end, double time0, double time1) {
+    std::vector<bvh_primitive_info> infos(end-start);
+    const auto n = static_cast<long>(end-start);
+
+    #pragma omp parallel for schedule(static) if(n >= static_cast<long>(bvh_builder::parallel_grain))
+    for (long k = 0; k < n; k++) {
+        size_t i = start + static_cast<size_t>(k);
+        auto& info = infos[i-start];
+        info.index = i;
+        if (!objects[i]->bounding_box(time0, time1, info.box))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        info.centroid = 0.5*(info.box.min()+info.box.max());
+    }
+    return infos;
+}
+
+bvh_builder::bvh_builder(const std::vector<shared_ptr<hittable>>& objects,
+        size_t start, size_t end, double time0, double time1, size_t _max_leaf_size)
+    : bvh_builder(primitive_infos(objects, start, end, time0, time1), _max_leaf_size) {}
+
+bvh_builder::bvh_builder(std::vector<bvh_primitive_info> _prims, size_t _max_leaf_size)
+    : max_leaf_size(_max_leaf_size < 1? 1:_max_leaf_size), prims(std::move(_prims))
+{
+    if (prims.empty()) return;
+
+    nodes.resize(2*prims.size()-1);
+    int root = allocate_node();
+
+    #pragma omp parallel if(prims.size() >= parallel_grain)
+    #pragma omp single
+    build(root, 0, prims.size(), 1);
+
+    nodes.resize(static_cast<size_t>(next_node.load()));
+    compute_stats(0, 1);
+}
+
+// Runs body(first, last, chunk) over scan_chunks pieces of [start, end) as tasks
+template <typename chunk_fn>
+void bvh_builder::for_chunks(size_t start, size_t end, chunk_fn&& body) {
+    const size_t chunk_size = (end-start+scan_chunks-1) / scan_chunks;
+    #pragma omp taskloop grainsize(1)
+    for (int c = 0; c < scan_chunks; c++) {
+        size_t first = start + static_cast<size_t>(c)*chunk_size;
+        size_t last = std::min(end, first+chunk_size);
+        if (first < last) body(first, last, c);
+    }
+}
+
+// Union of box_of(prims[i]) over the range
+template <typename box_fn>
+aabb bvh_builder::range_bounds(size_t start, size_t end, box_fn&& box_of) {
+    aabb bounds = empty_box();
+    if (end-start < parallel_scan_size) {
+        for (size_t i = start; i < end; i++)
+            bounds = surrounding_box(bounds, box_of(prims[i]));
+        return bounds;
+    }
+
+    aabb chunk_bounds[scan_chunks];
+    for (auto& b : chunk_bounds) b = empty_box();
+    for_chunks(start, end, [&](size_t first, size_t last, int c) {
+        for (size_t i = first; i < last; i++)
+            chunk_bounds[c] = surrounding_box(chunk_bounds[c], box_of(prims[i]));
+    });
+    for (const auto& b : chunk_bounds) bounds = surrounding_box(bounds, b);
+    return bounds;
+}
+
+void bvh_builder::build(int node_index, size_t start, size_t end, int depth) {
+    aabb bounds = range_bounds(start, end, [](const bvh_primitive_info& p) {return p.box;});
+
+    int axis = 0;
+    size_t mid = find_split(start, end, depth, bounds, axis);
+
+    auto& node = nodes[node_index];
+    node.box = bounds;
+
+    if (mid == start || mid == end) {
+        node.first = start;
+        node.count = end-start;
+        return;
+    }
+
+    int left = allocate_node();
+    int right = allocate_node();
+    node.axis = axis;
+    node.left = left;
+    node.right = right;
+
+    if (end-start >= parallel_grain) {
+        #pragma omp task
+        build(left, start, mid, depth+1);
+        build(right, mid, end, depth+1);
+        #pragma omp taskwait
+    } else {
+        build(left, start, mid, depth+1);
+        build(right, mid, end, depth+1);
+    }
+}
+
+// Returns the split position in [start, end), partitioning prims around it,
+// or start if the range should become a leaf.
+size_t bvh_builder::find_split(size_t start, size_t end, int depth, const aabb& bounds, int& axis) {
+    size_t count = end-start;
+    if (count == 1) return start;
+
+    aabb centroid_bounds = range_bounds(start, end,
+        [](const bvh_primitive_info& p) {return aabb(p.centroid, p.centroid);});
+
+    axis = centroid_bounds.longest_axis();
+    double cmin = centroid_bounds.min()[axis];
+    double cmax = centroid_bounds.max()[axis];
+
+    if (cmax <= cmin) {
+        // All centroids coincide, SAH can't separate them
+        if (count <= max_leaf_size) return start;
+        return start + count/2;
+    }
+
+    if (depth >= max_sah_depth) {
+        size_t mid = start + count/2;
+        std::nth_element(prims.begin()+start, prims.begin()+mid, prims.begin()+end,
+            [axis](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        return mid;
+    }
+
+    struct bin {
+        aabb box = empty_box();
+        size_t count = 0;
+    };
+
+    auto bin_of = [&](const bvh_primitive_info& p) {
+        int b = static_cast<int>(n_bins * ((p.centroid[axis]-cmin) / (cmax-cmin)));
+        return b < n_bins? b : n_bins-1;
+    };
+
+    bin bins[n_bins];
+    if (count < parallel_scan_size) {
+        for (size_t i = start; i < end; i++) {
+            auto& b = bins[bin_of(prims[i])];
+            b.count++;
+            b.box = surrounding_box(b.box, prims[i].box);
+        }
+    } else {
+        std::vector<bin> chunk_bins(scan_chunks*n_bins);
+        for_chunks(start, end, [&](size_t first, size_t last, int c) {
+            for (size_t i = first; i < last; i++) {
+                auto& b = chunk_bins[c*n_bins + bin_of(prims[i])];
+                b.count++;
+                b.box = surrounding_box(b.box, prims[i].box);
+            }
+        });
+        for (int c = 0; c < scan_chunks; c++) {
+            for (int i = 0; i < n_bins; i++) {
+                bins[i].count += chunk_bins[c*n_bins + i].count;
+                bins[i].box = surrounding_box(bins[i].box, chunk_bins[c*n_bins + i].box);
+            }
+        }
+    }
+
+    // Sweep from both sides to get the cost of every split plane in linear time
+    double cost[n_bins-1];
+    aabb acc = empty_box();
+    size_t acc_count = 0;
+    for (int i = 0; i < n_bins-1; i++) {
+        acc = surrounding_box(acc, bins[i].box);
+        acc_count += bins[i].count;
+        cost[i] = acc_count? static_cast<double>(acc_count)*acc.surface_area() : 0;
+    }
+    acc = empty_box();
+    acc_count = 0;
+    for (int i = n_bins-1; i > 0; i--) {
+        acc = surrounding_box(acc, bins[i].box);
+        acc_count += bins[i].count;
+        if (acc_count) cost[i-1] += static_cast<double>(acc_count)*acc.surface_area();
+    }
+
+    int best = 0;
+    for (int i = 1; i < n_bins-1; i++)
+        if (cost[i] < cost[best]) best = i;
+
+    double split_cost = traversal_cost + intersection_cost*cost[best]/bounds.surface_area();
+    double leaf_cost = intersection_cost*static_cast<double>(count);
+
+    if (count <= max_leaf_size && leaf_cost <= split_cost) return start;
+
+    auto mid_it = std::partition(
+        prims.begin()+start, prims.begin()+end,
+        [&](const bvh_primitive_info& p) {return bin_of(p) <= best;});
+    size_t mid = static_cast<size_t>(mid_it-prims.begin());
+
+    if (mid == start || mid == end) mid = start + count/2;
+    return mid;
+}
+
+// Counts and SAH cost are filled in afterwards, rather than shared between build tasks
+void bvh_builder::compute_stats(int node_index, int depth) {
+    double root_area = nodes[0].box.surface_area();
+    if (root_area <= 0) root_area = 1;
+
+    const auto& node = nodes[node_index];
+    double rel_area = node.box.surface_area() / root_area;
+    stats.node_count++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    if (node.is_leaf()) {
+        stats.leaf_count++;
+        stats.sah_cost += intersection_cost*static_cast<double>(node.count)*rel_area;
+        return;
+    }
+
+    stats.sah_cost += traversal_cost*rel_area;
+    compute_stats(node.left, depth+1);
+    compute_stats(node.right, depth+1);
+}
+
 class bvh_node: public hittable {
     public:
-        bvh_node();
+        bvh_node() {}
 
-        bvh_node(const hittable_list& list, double time0, double time1): 
+        bvh_node(const hittable_list& list, double time0, double time1):
             bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
 
         bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
@@ -20,6 +329,7 @@ class bvh_node: public hittable {
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
@@ -27,6 +337,12 @@ class bvh_node: public hittable {
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
         aabb box;
+        // Only filled in for the root of a tree
+        bvh_build_stats build_stats;
+
+    private:
+        void from_build_node(const bvh_builder& builder, int node_index,
+                const std::vector<shared_ptr<hittable>>& src_objects);
 };
 
 bool bvh_node::bounding_box(double time0, double time1, aabb &output_box) const {
@@ -43,75 +359,48 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     return hit_left || hit_right;
 }
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
-
-    if (!a->bounding_box(0,0, box_a) || !b->bounding_box(0,0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-
-    return box_a.min().e[axis] < box_b.min().e[axis];
-}
-
-
-bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
-}
-
-bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
-}
-
-bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    if (!box.hit(r, t_min, t_max)) return false;
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
 }
 
 bvh_node::bvh_node(
     const std::vector<shared_ptr<hittable>>& src_objects,
     size_t start, size_t end, double time0, double time1
 ) {
-    auto objects = src_objects; // copying the values?
-
-    int axis = random_int(0, 2);
-
-    auto comparator = (axis == 0)? box_x_compare :
-                      (axis == 1)? box_y_compare 
-                                 : box_z_compare;
-
-    size_t object_span = end-start;
-
-    if (object_span == 1){
-        left = right = objects[start];
-    } else if (object_span == 2){
-        size_t inxl, inxr;
-        if (comparator(objects[start], objects[start+1])){
-            inxl = start;
-            inxr = start+1;
-        } else {
-            inxr = start;
-            inxl = start+1;
-        }
-        left = objects[inxl];
-        right = objects[inxr];
-    } else {
-        std::sort(objects.begin()+start, objects.begin()+end, comparator);
-
-        auto mid = start+(object_span/2);
-
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+    // Leaves of a bvh_node hold at most its two children
+    bvh_builder builder(src_objects, start, end, time0, time1, 2);
+    if (builder.nodes.empty()) {
+        std::cerr << "Empty object list in bvh_node constructor.\n";
+        return;
     }
 
-    aabb box_left, box_right;
-
-    if (!(left->bounding_box(time0, time1, box_left)) ||
-        !(right->bounding_box(time0, time1, box_right))
-    ) std::cerr << "No bounding box in bvh constructor! \n";
-
-    box = surrounding_box(box_left, box_right);
+    from_build_node(builder, 0, src_objects);
+    build_stats = builder.stats;
 }
 
+void bvh_node::from_build_node(const bvh_builder& builder, int node_index,
+        const std::vector<shared_ptr<hittable>>& src_objects) {
+    const auto& node = builder.nodes[node_index];
+    box = node.box;
 
+    if (node.is_leaf()) {
+        left = src_objects[builder.prims[node.first].index];
+        right = (node.count > 1)? src_objects[builder.prims[node.first+1].index] : left;
+        return;
+    }
 
+    auto child = [&](int index) -> shared_ptr<hittable> {
+        const auto& c = builder.nodes[index];
+        if (c.is_leaf() && c.count == 1)
+            return src_objects[builder.prims[c.first].index];
+        auto n = make_shared<bvh_node>();
+        n->from_build_node(builder, index, src_objects);
+        return n;
+    };
+
+    left = child(node.left);
+    right = child(node.right);
+}
 
-#endif 
+#endif
@@ -0,0 +1,335 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "primitive_table.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define RTW_BVH4_SSE 1
+#endif
+
+// 4-wide BVH, the binary SAH tree from bvh_builder with every other level collapsed
+// into its parent. A node stores the boxes of all its children as structure of arrays,
+// one float per child and lane, so a single ray is tested against all four children
+// with a handful of SSE instructions instead of four separate slab tests.
+// SSE is baseline on x86-64, so this doesn't need -march flags (AVX/BVH8 would).
+struct alignas(64) bvh4_node {
+    float bounds_min[3][4];     // [axis][child]
+    float bounds_max[3][4];
+    int32_t child[4];           // interior child: node index, leaf child: first primitive (range)
+    uint16_t count[4];          // primitives of a leaf child, 0 for interior children
+    uint8_t n_children;
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node should fill two cache lines");
+
+// Up to three siblings are pushed per visited node, so this is roomier than linear_bvh's
+const int bvh4_stack_size = 256;
+
+// Picks up to four subtrees below build_index: keeps opening up the interior child with
+// the largest surface area, that's the one most likely to be visited anyway.
+inline int collect_bvh4_children(const bvh_builder& builder, int build_index, int children[4]) {
+    const auto& node = builder.nodes[build_index];
+    int n = 2;
+    children[0] = node.left;
+    children[1] = node.right;
+
+    while (n < 4) {
+        int best = -1;
+        double best_area = -1;
+        for (int i = 0; i < n; i++) {
+            const auto& c = builder.nodes[children[i]];
+            if (!c.is_leaf() && c.box.surface_area() > best_area) {
+                best = i;
+                best_area = c.box.surface_area();
+            }
+        }
+        if (best < 0) break;
+
+        const auto& opened = builder.nodes[children[best]];
+        children[best] = opened.left;
+        children[n++] = opened.right;
+    }
+    return n;
+}
+
+inline int collapse_bvh4(const bvh_builder& builder, int build_index, std::vector<bvh4_node>& out) {
+    int offset = static_cast<int>(out.size());
+    out.emplace_back();
+
+    int children[4];
+    int n = collect_bvh4_children(builder, build_index, children);
+
+    // Unused lanes get an inverted box, which no ray can hit
+    bvh4_node wide;
+    memset(&wide, 0, sizeof(wide)); // no stray padding bytes in cache files
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < 4; i++) {
+            wide.bounds_min[a][i] = std::numeric_limits<float>::infinity();
+            wide.bounds_max[a][i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+    wide.n_children = static_cast<uint8_t>(n);
+
+    for (int i = 0; i < n; i++) {
+        const auto& c = builder.nodes[children[i]];
+        for (int a = 0; a < 3; a++) {
+            wide.bounds_min[a][i] = round_down(c.box.min()[a]);
+            wide.bounds_max[a][i] = round_up(c.box.max()[a]);
+        }
+        if (c.is_leaf()) {
+            wide.child[i] = static_cast<int32_t>(c.first);
+            wide.count[i] = static_cast<uint16_t>(c.count);
+        } else {
+            wide.child[i] = collapse_bvh4(builder, children[i], out);
+        }
+    }
+
+    out[offset] = wide;
+    return offset;
+}
+
+// The root of a bvh4 is always an interior node, a tree that is a single leaf gets
+// wrapped into a node with one child.
+inline std::vector<bvh4_node> collapse_bvh4(const bvh_builder& builder) {
+    std::vector<bvh4_node> out;
+    if (builder.nodes.empty()) return out;
+    out.reserve(builder.nodes.size()/2 + 1);
+
+    const auto& root = builder.nodes[0];
+    if (!root.is_leaf()) {
+        collapse_bvh4(builder, 0, out);
+        return out;
+    }
+
+    bvh4_node wide;
+    memset(&wide, 0, sizeof(wide)); // no stray padding bytes in cache files
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < 4; i++) {
+            wide.bounds_min[a][i] = std::numeric_limits<float>::infinity();
+            wide.bounds_max[a][i] = -std::numeric_limits<float>::infinity();
+        }
+        wide.bounds_min[a][0] = round_down(root.box.min()[a]);
+        wide.bounds_max[a][0] = round_up(root.box.max()[a]);
+    }
+    wide.count[0] = static_cast<uint16_t>(root.count);
+    wide.n_children = 1;
+    out.push_back(wide);
+    return out;
+}
+
+// The boxes are tested in float, so the exit distance gets a little slack to make up
+// for rounding the ray to float. Extra box hits only cost time, misses would leave holes.
+const float bvh4_t_far_slack = 1.0f + 1e-5f;
+
+// Slab test of one ray against the four children of a node. Returns a bit mask of the
+// children that were hit and writes their entry distances to t_near.
+inline int bvh4_node_hit(const bvh4_node& node, const ray& r, float t_min, float t_max, float t_near[4]) {
+#ifdef RTW_BVH4_SSE
+    __m128 near_v = _mm_set1_ps(t_min);
+    __m128 far_v = _mm_set1_ps(t_max);
+
+    for (int a = 0; a < 3; a++) {
+        const __m128 orig = _mm_set1_ps(static_cast<float>(r.orig[a]));
+        const __m128 inv = _mm_set1_ps(static_cast<float>(r.inv_direction()[a]));
+        const float* near_plane = r.sign[a]? node.bounds_max[a] : node.bounds_min[a];
+        const float* far_plane = r.sign[a]? node.bounds_min[a] : node.bounds_max[a];
+
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane), orig), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane), orig), inv);
+        // max/min return their second operand if either is NaN, which keeps the old bound
+        near_v = _mm_max_ps(t0, near_v);
+        far_v = _mm_min_ps(t1, far_v);
+    }
+
+    far_v = _mm_mul_ps(far_v, _mm_set1_ps(bvh4_t_far_slack));
+    _mm_storeu_ps(t_near, near_v);
+    return _mm_movemask_ps(_mm_cmple_ps(near_v, far_v)) & ((1 << node.n_children) - 1);
+#else
+    int mask = 0;
+    for (int i = 0; i < node.n_children; i++) {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; a++) {
+            const auto orig = static_cast<float>(r.orig[a]);
+            const auto inv = static_cast<float>(r.inv_direction()[a]);
+            float tn = ((r.sign[a]? node.bounds_max[a][i] : node.bounds_min[a][i]) - orig) * inv;
+            float tf = ((r.sign[a]? node.bounds_min[a][i] : node.bounds_max[a][i]) - orig) * inv;
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        t_near[i] = t0;
+        if (t0 <= t1*bvh4_t_far_slack) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Same contract as traverse_linear_bvh. Children that were hit are pushed far to near, and
+// popped entries whose box starts beyond the closest hit so far are skipped without a test.
+template <bool any_hit = false, typename leaf_hit_fn>
+bool traverse_bvh4(const bvh4_node* nodes, const ray& r, double t_min, double t_max,
+        leaf_hit_fn&& leaf_hit) {
+    struct entry {
+        int32_t index;
+        uint16_t count;     // > 0 for a primitive range
+        float t_near;
+    };
+
+    entry stack[bvh4_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, static_cast<float>(t_min)};
+    bool hit_anything = false;
+    const auto t_min_f = static_cast<float>(t_min);
+
+    while (stack_size > 0) {
+        const entry e = stack[--stack_size];
+        if (e.t_near > t_max) continue;
+
+        if (e.count > 0) {
+            if (leaf_hit(e.index, e.count, t_max)) {
+                if (any_hit) return true;
+                hit_anything = true;
+            }
+            continue;
+        }
+
+        const auto& node = nodes[e.index];
+        float t_near[4];
+        int mask = bvh4_node_hit(node, r, t_min_f, static_cast<float>(t_max), t_near);
+
+        // At most four entries, insertion sort them by decreasing distance
+        entry hits[4];
+        int n_hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i))) continue;
+            entry h = {node.child[i], node.count[i], t_near[i]};
+            int k = n_hits++;
+            while (k > 0 && hits[k-1].t_near < h.t_near) {
+                hits[k] = hits[k-1];
+                k--;
+            }
+            hits[k] = h;
+        }
+        for (int i = 0; i < n_hits; i++) stack[stack_size++] = hits[i];
+    }
+
+    return hit_anything;
+}
+
+// Leaves reference ranges of primitive_tables rather than hittables, see primitive_table.h.
+// Lists and boxes handed to the constructor are opened up into their primitives.
+class bvh4: public hittable {
+    public:
+        static const size_t max_leaf_size = max_range_size;
+
+        bvh4() {}
+        bvh4(const hittable_list& list, double time0, double time1):
+            bvh4(list.objects, time0, time1) {}
+        bvh4(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+    private:
+        void build_tables(bvh_builder& builder, int node_index, const std::vector<shared_ptr<hittable>>& objects);
+
+    public:
+        // Keeps the primitives (and their materials) alive, the tables only point at them
+        std::vector<shared_ptr<hittable>> primitives;
+        primitive_tables tables;
+        // A leaf child of a node is ranges [child, child+count), one per primitive type
+        std::vector<primitive_range> ranges;
+        std::vector<bvh4_node> nodes;
+        aabb box;
+        bvh_build_stats build_stats;
+};
+
+bvh4::bvh4(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1) {
+    std::vector<shared_ptr<hittable>> objects;
+    objects.reserve(src_objects.size());
+    for (const auto& object : src_objects) gather_primitives(object, objects);
+
+    bvh_builder builder(objects, 0, objects.size(), time0, time1, max_leaf_size);
+    if (builder.nodes.empty()) {
+        std::cerr << "Empty object list in bvh4 constructor.\n";
+        return;
+    }
+
+    primitives.reserve(builder.prims.size());
+    build_tables(builder, 0, objects);
+
+    nodes = collapse_bvh4(builder);
+    box = builder.nodes[0].box;
+    build_stats = builder.stats;
+}
+
+// Fills the tables depth first, so nearby leaves use nearby table entries, and turns the
+// primitive range of every leaf into its per type ranges.
+void bvh4::build_tables(bvh_builder& builder, int node_index, const std::vector<shared_ptr<hittable>>& objects) {
+    auto& node = builder.nodes[node_index];
+    if (!node.is_leaf()) {
+        build_tables(builder, node.left, objects);
+        build_tables(builder, node.right, objects);
+        return;
+    }
+
+    struct typed {primitive_type type; size_t index;};
+    typed leaf[max_leaf_size];
+    for (size_t k = 0; k < node.count; k++) {
+        const size_t index = builder.prims[node.first+k].index;
+        leaf[k] = {primitive_tables::type_of(*objects[index]), index};
+    }
+    std::stable_sort(leaf, leaf+node.count, [](const typed& a, const typed& b) {return a.type < b.type;});
+
+    const size_t first_range = ranges.size();
+    for (size_t k = 0; k < node.count; k++) {
+        const auto& object = objects[leaf[k].index];
+        primitives.push_back(object);
+        const uint32_t index = tables.add(*object, leaf[k].type);
+        if (k > 0 && leaf[k].type == leaf[k-1].type) ranges.back().count++;
+        else ranges.push_back({index, 1, leaf[k].type});
+    }
+    node.first = first_range;
+    node.count = ranges.size() - first_range;
+}
+
+bool bvh4::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty()) return false;
+
+    return traverse_bvh4(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double& closest) {
+            bool hit_leaf = false;
+            for (int i = first; i < first+count; i++)
+                if (tables.hit(ranges[i], r, t_min, closest, rec)) hit_leaf = true;
+            return hit_leaf;
+        });
+}
+
+bool bvh4::occluded(const ray& r, double t_min, double t_max) const {
+    if (nodes.empty()) return false;
+
+    return traverse_bvh4<true>(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double&) {
+            for (int i = first; i < first+count; i++)
+                if (tables.occluded(ranges[i], r, t_min, t_max)) return true;
+            return false;
+        });
+}
+
+#endif
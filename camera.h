@@ -35,7 +35,7 @@ class camera {
             time1 = _time1;
         }
 
-        ray get_ray(double s, double t){
+        ray get_ray(double s, double t) const {
             vec3 rd = lens_radius*random_in_unit_disk();
             vec3 offset = u*rd.x() + v*rd.y();
 
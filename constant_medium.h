@@ -10,10 +10,10 @@
 class constant_medium: public hittable {
     public:
         constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a): 
-            boundary(b), neg_inv_density(-1./d), phase_function(make_shared<isotropic>(a)) {}
+            boundary(b), neg_inv_density(-1./d), phase_function(make_pooled<isotropic>(a)) {}
 
         constant_medium(shared_ptr<hittable> b, double d, color c):
-            boundary(b), neg_inv_density(-1./d), phase_function(make_shared<isotropic>(c)) {}
+            boundary(b), neg_inv_density(-1./d), phase_function(make_pooled<isotropic>(c)) {}
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
@@ -34,7 +34,7 @@ bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &
     if (!boundary->hit(r, -infinity, infinity, rec1))
         return false;
 
-    if (!boundary->hit(r, rec1.t+0.000001, infinity, rec2))
+    if (!boundary->hit(r, rec1.t+ray_epsilon, infinity, rec2))
         return false;
 
     if (rec1.t < t_min) rec1.t = t_min;
@@ -58,7 +58,7 @@ bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &
 
     rec.normal = vec3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
 
     return true;
 }
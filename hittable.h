@@ -11,7 +11,9 @@ class material;
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    // Non-owning, the primitive that was hit keeps its material alive. Keeping this a raw
+    // pointer means filling in and copying hit records never touches a refcount.
+    const material* mat_ptr;
     double t;
     double u;
     double v;
@@ -26,9 +28,18 @@ struct hit_record {
 class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        // Any hit in (t_min, t_max), for shadow rays. Overrides stop at the first hit they
+        // find and skip the shading data hit() fills in.
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
         virtual double pdf_value(const point3& o, const vec3& v) const {return 0.0;}
         virtual vec3 random(const vec3& o) const {return vec3(1, 0, 0);}
+        // For weighting lights by power. Containers and transforms pass on their contents'
+        // area, 0 means unknown (light_sampler then falls back to the bounding box).
+        virtual double surface_area() const {return 0.0;}
 };
 
 class translate: public hittable {
@@ -36,6 +47,10 @@ class translate: public hittable {
         translate(shared_ptr<hittable> p, const vec3& displacement): ptr(p), offset(displacement) {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(ray(r.origin()-offset, r.direction(), r.time()), t_min, t_max);
+        }
+        virtual double surface_area() const override {return ptr->surface_area();}
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
     public:
@@ -66,12 +81,20 @@ class rotate_y : public hittable {
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(rotated(r), t_min, t_max);
+        }
+        virtual double surface_area() const override {return ptr->surface_area();}
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
         }
 
+    private:
+        // The ray in the object's frame
+        ray rotated(const ray& r) const;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -102,8 +125,8 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
                 vec3 tester(newx, y, newz);
 
                 for (int c = 0; c < 3; c++) {
-                    min[c] = fmin(min[c], tester[c]);
-                    max[c] = fmax(max[c], tester[c]);
+                    min[c] = static_cast<vec3_real>(fmin(min[c], tester[c]));
+                    max[c] = static_cast<vec3_real>(fmax(max[c], tester[c]));
                 }
             }
         }
@@ -112,29 +135,26 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
+ray rotate_y::rotated(const ray& r) const {
+    const auto& o = r.origin();
+    const auto& d = r.direction();
 
-    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-    origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+    point3 origin(cos_theta*o[0] - sin_theta*o[2], o[1], sin_theta*o[0] + cos_theta*o[2]);
+    vec3 direction(cos_theta*d[0] - sin_theta*d[2], d[1], sin_theta*d[0] + cos_theta*d[2]);
 
-    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
+    return ray(origin, direction, r.time());
+}
 
-    ray rotated_r(origin, direction, r.time());
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray rotated_r = rotated(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
 
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    p[0] =  cos_theta*rec.p[0] + sin_theta*rec.p[2];
-    p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
-
-    normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
-    normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
+    point3 p( cos_theta*rec.p[0] + sin_theta*rec.p[2], rec.p[1],
+             -sin_theta*rec.p[0] + cos_theta*rec.p[2]);
+    vec3 normal( cos_theta*rec.normal[0] + sin_theta*rec.normal[2], rec.normal[1],
+                -sin_theta*rec.normal[0] + cos_theta*rec.normal[2]);
 
     rec.p = p;
     rec.set_face_normal(rotated_r, normal);
@@ -152,6 +172,9 @@ class flip_face: public hittable {
             rec.front_face = !rec.front_face;
             return true;
         }
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(r, t_min, t_max);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             return ptr->bounding_box(time0, time1, output_box);
@@ -162,6 +185,9 @@ class flip_face: public hittable {
         virtual vec3 random(const vec3& o) const override {
             return ptr->random(o);
         }
+        virtual double surface_area() const override {
+            return ptr->surface_area();
+        }
     public:
         shared_ptr<hittable> ptr;
 };
@@ -18,30 +18,37 @@ class hittable_list: public hittable {
         void add(shared_ptr<hittable> object){objects.push_back(object);}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
         virtual double pdf_value(const point3& o, const vec3& v) const override;
         virtual vec3 random(const point3& o) const override;
+        virtual double surface_area() const override;
     public:
         std::vector<shared_ptr<hittable>> objects;
 
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
+    // hit() only writes rec on success, so no temporary record is needed
     for(const auto& object:objects){
-        if(object->hit(r, t_min, closest_so_far, temp_rec)){
+        if(object->hit(r, t_min, closest_so_far, rec)){
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects)
+        if (object->occluded(r, t_min, t_max)) return true;
+    return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb &output_box) const {
     if (objects.empty()) return false;
     
@@ -56,6 +63,12 @@ bool hittable_list::bounding_box(double time0, double time1, aabb &output_box) c
 
     return true;
 }
+double hittable_list::surface_area() const {
+    double area = 0;
+    for (const auto& object : objects) area += object->surface_area();
+    return area;
+}
+
 // TODO if no objects in the hittable list, uniform sampling?
 
 double hittable_list::pdf_value(const point3& o, const vec3& v) const {
@@ -0,0 +1,192 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Writes finished frames straight to disk. Pixels are linear radiance (already divided
+// by the sample count), stored row by row from the top of the image.
+//
+// Formats are picked from the file extension:
+//   .ppm/.pnm  binary P6
+//   .png       8-bit RGB PNG
+//   .pfm       32-bit float RGB (HDR, no tonemapping)
+// A path of "-" writes P6 to stdout, so `riow | pnmtopng > out.png` still works.
+
+// Gamma-corrects (gamma 2.2, like write_color) and quantizes to 8 bit RGB, in parallel.
+std::vector<unsigned char> to_8bit_rgb(const std::vector<color>& pixels) {
+    std::vector<unsigned char> out(3*pixels.size());
+    const auto inv_gamma = 1./2.2f;
+    const long n = static_cast<long>(pixels.size());
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        for (int c = 0; c < 3; c++) {
+            auto value = pow(pixels[i][c], inv_gamma);
+            out[3*i+c] = static_cast<unsigned char>(256 * clamp(value, 0.0, 0.999));
+        }
+    }
+    return out;
+}
+
+bool write_ppm(FILE* file, const std::vector<color>& pixels, int width, int height) {
+    auto rgb = to_8bit_rgb(pixels);
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    return fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+}
+
+namespace png_detail {
+    inline uint32_t crc32(const unsigned char* data, size_t n, uint32_t crc = 0) {
+        static uint32_t table[256];
+        static bool table_ready = false;
+        if (!table_ready) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c & 1)? 0xedb88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+            table_ready = true;
+        }
+        crc = ~crc;
+        for (size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    inline void put_u32(std::vector<unsigned char>& out, uint32_t v) {
+        out.push_back(static_cast<unsigned char>(v >> 24));
+        out.push_back(static_cast<unsigned char>(v >> 16));
+        out.push_back(static_cast<unsigned char>(v >> 8));
+        out.push_back(static_cast<unsigned char>(v));
+    }
+
+    inline bool write_chunk(FILE* file, const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> head;
+        put_u32(head, static_cast<uint32_t>(data.size()));
+        head.insert(head.end(), type, type+4);
+
+        uint32_t crc = crc32(head.data()+4, 4);
+        crc = crc32(data.data(), data.size(), crc);
+        std::vector<unsigned char> tail;
+        put_u32(tail, crc);
+
+        return fwrite(head.data(), 1, head.size(), file) == head.size()
+            && fwrite(data.data(), 1, data.size(), file) == data.size()
+            && fwrite(tail.data(), 1, tail.size(), file) == tail.size();
+    }
+}
+
+// The image data is stored as uncompressed deflate blocks, which needs no zlib and
+// costs nothing to encode; the file is about as large as a P6.
+bool write_png(FILE* file, const std::vector<color>& pixels, int width, int height) {
+    using namespace png_detail;
+
+    auto rgb = to_8bit_rgb(pixels);
+    const size_t row_bytes = 3*static_cast<size_t>(width);
+
+    // Every scanline starts with its filter type, 0 = none
+    std::vector<unsigned char> raw;
+    raw.reserve((row_bytes+1)*height);
+    for (int j = 0; j < height; j++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin()+j*row_bytes, rgb.begin()+(j+1)*row_bytes);
+    }
+
+    std::vector<unsigned char> idat;
+    idat.reserve(raw.size() + raw.size()/65535*5 + 16);
+    idat.push_back(0x78); idat.push_back(0x01);
+    size_t pos = 0;
+    do {
+        size_t len = std::min<size_t>(65535, raw.size()-pos);
+        bool last = pos+len == raw.size();
+        idat.push_back(last? 1:0);
+        idat.push_back(static_cast<unsigned char>(len & 0xff));
+        idat.push_back(static_cast<unsigned char>(len >> 8));
+        idat.push_back(static_cast<unsigned char>(~len & 0xff));
+        idat.push_back(static_cast<unsigned char>((~len >> 8) & 0xff));
+        idat.insert(idat.end(), raw.begin()+pos, raw.begin()+pos+len);
+        pos += len;
+    } while (pos < raw.size());
+
+    uint32_t a = 1, b = 0;
+    for (auto byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_u32(idat, (b << 16) | a);
+
+    std::vector<unsigned char> ihdr;
+    put_u32(ihdr, static_cast<uint32_t>(width));
+    put_u32(ihdr, static_cast<uint32_t>(height));
+    ihdr.push_back(8); // bit depth
+    ihdr.push_back(2); // truecolor RGB
+    ihdr.push_back(0); ihdr.push_back(0); ihdr.push_back(0);
+
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    return fwrite(signature, 1, 8, file) == 8
+        && write_chunk(file, "IHDR", ihdr)
+        && write_chunk(file, "IDAT", idat)
+        && write_chunk(file, "IEND", std::vector<unsigned char>());
+}
+
+// PFM stores rows bottom to top, a negative scale marks little endian data.
+bool write_pfm(FILE* file, const std::vector<color>& pixels, int width, int height) {
+    std::vector<float> data(3*pixels.size());
+
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < height; j++) {
+        const auto* src = &pixels[static_cast<size_t>(height-1-j)*width];
+        auto* dst = &data[3*static_cast<size_t>(j)*width];
+        for (int i = 0; i < width; i++) {
+            dst[3*i+0] = static_cast<float>(src[i].x());
+            dst[3*i+1] = static_cast<float>(src[i].y());
+            dst[3*i+2] = static_cast<float>(src[i].z());
+        }
+    }
+
+    const uint16_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<const unsigned char*>(&endian_probe) == 1;
+    fprintf(file, "PF\n%d %d\n%s\n", width, height, little_endian? "-1.0":"1.0");
+    return fwrite(data.data(), sizeof(float), data.size(), file) == data.size();
+}
+
+inline bool has_extension(const std::string& path, const std::string& ext) {
+    if (path.size() < ext.size()) return false;
+    for (size_t i = 0; i < ext.size(); i++) {
+        if (tolower(path[path.size()-ext.size()+i]) != ext[i]) return false;
+    }
+    return true;
+}
+
+bool write_image(const std::string& path, const std::vector<color>& pixels, int width, int height) {
+    if (path == "-") {
+        bool ok = write_ppm(stdout, pixels, width, height);
+        fflush(stdout);
+        return ok;
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "ERROR: Couldn't open output image '" << path << "' for writing.\n";
+        return false;
+    }
+
+    bool ok;
+    if (has_extension(path, ".png")) {
+        ok = write_png(file, pixels, width, height);
+    } else if (has_extension(path, ".pfm")) {
+        ok = write_pfm(file, pixels, width, height);
+    } else {
+        ok = write_ppm(file, pixels, width, height);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) std::cerr << "ERROR: Failed writing output image '" << path << "'.\n";
+    return ok;
+}
+
+#endif
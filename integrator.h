@@ -0,0 +1,259 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <string>
+
+enum class integrator_type {
+    recursive,  // ray_color
+    iterative,  // ray_color_iterative, with russian roulette
+    wavefront,  // ray_color's estimator, a wave of paths at a time, see wavefront.h
+    nee,        // ray_color_nee, next-event estimation with MIS
+};
+
+inline bool parse_integrator(const std::string& name, integrator_type& out) {
+    if (name == "recursive") out = integrator_type::recursive;
+    else if (name == "iterative") out = integrator_type::iterative;
+    else if (name == "wavefront") out = integrator_type::wavefront;
+    else if (name == "nee") out = integrator_type::nee;
+    else return false;
+    return true;
+}
+
+inline const char* integrator_name(integrator_type type) {
+    switch (type) {
+        case integrator_type::iterative: return "iterative";
+        case integrator_type::wavefront: return "wavefront";
+        case integrator_type::nee: return "nee";
+        default: return "recursive";
+    }
+}
+
+color ray_color(
+        const ray& r, 
+        const shared_ptr<texture>& background, 
+        const shared_ptr<pdf>& background_pdf, 
+        const hittable& world, 
+        const shared_ptr<hittable>& lights, 
+        int depth) {
+    hit_record rec;
+    
+
+    if (depth <= 0){
+        return color(0, 0, 0);
+    }
+    if(!world.hit(r, ray_epsilon, infinity, rec)){
+        auto unit_dir = unit_vector(r.direction());
+        double u, v; get_spherical_uv(unit_dir, u, v);
+        return background->value(u, v, unit_dir);
+    }
+
+    scatter_record srec;
+    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+
+    if (!rec.mat_ptr->scatter(r, rec, srec)){
+        return emitted;
+    }
+
+    // no importance sampling
+    if (srec.is_specular){
+        return srec.attenuation * ray_color(srec.specular_ray, background, background_pdf, world, lights, depth-1);
+    }
+
+    // All on the stack, a bounce shouldn't hit the allocator
+    hittable_pdf light_pdf(*lights, rec.p);
+    mixture_pdf p_objs(light_pdf, srec.diffuse_pdf, 0.5);
+    mixture_pdf p(p_objs, *background_pdf, 0.8);
+
+    ray scattered = ray(rec.p, p.generate(), r.time());
+    auto pdf_val = p.value(scattered.direction());
+
+    return emitted + 
+        srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered)
+                         * ray_color(scattered, background, background_pdf, world, lights, depth-1) / pdf_val;
+}
+
+// Same estimator as ray_color, but as a loop carrying the path throughput, so the
+// depth cap can be raised without growing the stack. From rr_min_depth bounces on,
+// paths are terminated with probability 1-q (q = largest throughput component,
+// capped at 0.95) and survivors are divided by q, which keeps the estimate unbiased.
+color ray_color_iterative(
+        const ray& r_in,
+        const shared_ptr<texture>& background,
+        const shared_ptr<pdf>& background_pdf,
+        const hittable& world,
+        const shared_ptr<hittable>& lights,
+        int max_depth,
+        int rr_min_depth = 3) {
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray r = r_in;
+
+    for (int depth = 0; depth < max_depth; depth++) {
+        hit_record rec;
+        if(!world.hit(r, ray_epsilon, infinity, rec)){
+            auto unit_dir = unit_vector(r.direction());
+            double u, v; get_spherical_uv(unit_dir, u, v);
+            radiance += throughput * background->value(u, v, unit_dir);
+            break;
+        }
+
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+
+        if (!rec.mat_ptr->scatter(r, rec, srec)){
+            radiance += throughput * emitted;
+            break;
+        }
+
+        if (srec.is_specular){
+            // Like ray_color, emission of specular surfaces is ignored
+            throughput = throughput * srec.attenuation;
+            r = srec.specular_ray;
+        } else {
+            radiance += throughput * emitted;
+
+            hittable_pdf light_pdf(*lights, rec.p);
+            mixture_pdf p_objs(light_pdf, srec.diffuse_pdf, 0.5);
+            mixture_pdf p(p_objs, *background_pdf, 0.8);
+
+            ray scattered = ray(rec.p, p.generate(), r.time());
+            auto pdf_val = p.value(scattered.direction());
+
+            throughput = throughput * srec.attenuation
+                * (rec.mat_ptr->scattering_pdf(r, rec, scattered) / pdf_val);
+            r = scattered;
+        }
+
+        if (depth+1 >= rr_min_depth) {
+            double q = std::min(0.95, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+            if (!(q > 0) || random_double() >= q) break;
+            throughput /= q;
+        }
+    }
+
+    return radiance;
+}
+
+// Power heuristic (beta = 2) weight of a sample taken with pdf a, against a strategy with pdf b.
+// Written as a ratio so it doesn't overflow for near-delta pdfs.
+inline double power_heuristic(double a, double b) {
+    if (!(a > 0)) return 0;
+    if (!(b > 0)) return 1;
+    const double r = b/a;
+    return 1/(1 + r*r);
+}
+
+// Path tracer with next-event estimation: at every diffuse hit it samples a light and the
+// background with explicit shadow rays, and the path continues by sampling the BSDF alone.
+// Emission and background found by the BSDF ray are counted too, each sample is weighted
+// with the power heuristic against the strategy that could also have produced it, so the
+// two estimates add up without double counting. Lights a shadow ray can't see (or a path
+// after a specular bounce, where nothing can be sampled) get full weight.
+// Russian roulette as in ray_color_iterative.
+color ray_color_nee(
+        const ray& r_in,
+        const shared_ptr<texture>& background,
+        const shared_ptr<pdf>& background_pdf,
+        const hittable& world,
+        const shared_ptr<hittable>& lights,
+        int max_depth,
+        int rr_min_depth = 3) {
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray r = r_in;
+
+    aabb lights_box;
+    const bool has_lights = lights->bounding_box(0, 1, lights_box);
+
+    // pdf of the BSDF sample that spawned r, 0 for camera rays and after specular bounces
+    double bsdf_pdf = 0;
+
+    auto background_value = [&](const vec3& direction) {
+        auto unit_dir = unit_vector(direction);
+        double u, v; get_spherical_uv(unit_dir, u, v);
+        return background->value(u, v, unit_dir);
+    };
+
+    for (int depth = 0; depth < max_depth; depth++) {
+        hit_record rec;
+        if(!world.hit(r, ray_epsilon, infinity, rec)){
+            double w = 1;
+            if (bsdf_pdf > 0) w = power_heuristic(bsdf_pdf, background_pdf->value(r.direction()));
+            radiance += throughput * w * background_value(r.direction());
+            break;
+        }
+
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+        if (bsdf_pdf > 0 && has_lights && !emitted.near_zero())
+            emitted *= power_heuristic(bsdf_pdf, lights->pdf_value(r.origin(), r.direction()));
+
+        if (!rec.mat_ptr->scatter(r, rec, srec)){
+            radiance += throughput * emitted;
+            break;
+        }
+
+        if (srec.is_specular){
+            // Like ray_color, emission of specular surfaces is ignored
+            throughput = throughput * srec.attenuation;
+            r = srec.specular_ray;
+            bsdf_pdf = 0;
+        } else {
+            radiance += throughput * emitted;
+
+            // Light sample. The light list only holds shapes, the emission comes from
+            // whatever the shadow ray hits in the world.
+            if (has_lights) {
+                ray shadow(rec.p, lights->random(rec.p), r.time());
+                const double light_pdf = lights->pdf_value(shadow.origin(), shadow.direction());
+                const double f = rec.mat_ptr->scattering_pdf(r, rec, shadow);
+                hit_record light_rec;
+                if (light_pdf > 0 && f > 0 && world.hit(shadow, ray_epsilon, infinity, light_rec)) {
+                    color le = light_rec.mat_ptr->emitted(shadow, light_rec, light_rec.u, light_rec.v, light_rec.p);
+                    const double w = power_heuristic(light_pdf, srec.diffuse_pdf.value(shadow.direction()));
+                    radiance += throughput * srec.attenuation * le * (f * w / light_pdf);
+                }
+            }
+
+            // Background sample, it only needs to know whether the sky is visible
+            {
+                ray shadow(rec.p, background_pdf->generate(), r.time());
+                const double bg_pdf = background_pdf->value(shadow.direction());
+                const double f = rec.mat_ptr->scattering_pdf(r, rec, shadow);
+                if (bg_pdf > 0 && f > 0) {
+                    color bg = background_value(shadow.direction());
+                    if (!bg.near_zero() && !world.occluded(shadow, ray_epsilon, infinity)) {
+                        const double w = power_heuristic(bg_pdf, srec.diffuse_pdf.value(shadow.direction()));
+                        radiance += throughput * srec.attenuation * bg * (f * w / bg_pdf);
+                    }
+                }
+            }
+
+            ray scattered = ray(rec.p, srec.diffuse_pdf.generate(), r.time());
+            bsdf_pdf = srec.diffuse_pdf.value(scattered.direction());
+            if (!(bsdf_pdf > 0)) break;
+
+            throughput = throughput * srec.attenuation
+                * (rec.mat_ptr->scattering_pdf(r, rec, scattered) / bsdf_pdf);
+            r = scattered;
+        }
+
+        if (depth+1 >= rr_min_depth) {
+            double q = std::min(0.95, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+            if (!(q > 0) || random_double() >= q) break;
+            throughput /= q;
+        }
+    }
+
+    return radiance;
+}
+
+#endif
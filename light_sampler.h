@@ -0,0 +1,234 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "alias_table.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Picks the light a light sample goes to, and stands in for the list of lights in
+// hittable_pdf. Three ways to pick one:
+//   uniform  every light equally often, like hittable_list::random
+//   power    in proportion to the light's power, through an alias table
+//   spatial  walking down a BVH over the lights, at every node choosing a child by its
+//            power over the squared distance to the shading point
+//
+// Power is surface area unless the scene gives the lights' powers: the light lists are
+// material-less proxies of the emitters, so there is no emission to look at. Lists, boxes,
+// transforms and meshes report the area of what they hold; a light without an area is
+// weighted by its bounding box (with a warning) rather than never being picked. Some lists
+// also hold non-emitters as sampling targets (the glass sphere of the cornell box), which
+// is why uniform stays the default.
+//
+// pdf_value() only has to look at lights the direction can hit, so it walks the same BVH
+// with the ray and only visits lights whose box the ray enters. In spatial mode it
+// recomputes the branch probabilities on the way down, exactly as random() drew them.
+enum class light_sampling {uniform, power, spatial};
+
+inline bool parse_light_sampling(const std::string& name, light_sampling& out) {
+    if (name == "uniform") out = light_sampling::uniform;
+    else if (name == "power") out = light_sampling::power;
+    else if (name == "spatial") out = light_sampling::spatial;
+    else return false;
+    return true;
+}
+
+class light_sampler: public hittable {
+    public:
+        light_sampler(const hittable_list& lights, light_sampling _mode)
+            : light_sampler(lights, _mode, std::vector<double>()) {}
+        // powers[i] is the power of lights.objects[i], empty for surface areas
+        light_sampler(const hittable_list& lights, light_sampling _mode, std::vector<double> powers);
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o) const override;
+
+        size_t size() const {return lights.size();}
+
+    public:
+        light_sampling mode;
+
+    private:
+        struct node {
+            aabb box;
+            double power;               // of all lights below
+            int left = -1, right = -1;
+            uint32_t first = 0, count = 0;  // leaves: range of lights
+
+            bool is_leaf() const {return left < 0;}
+        };
+
+        // Weight of picking this subtree from o in spatial mode
+        double importance(const node& n, const point3& o) const;
+        // Probability of the left child, given the parent was picked
+        double left_probability(const node& n, const point3& o) const;
+        // Probability of lights[i] once its leaf was picked (or of lights[i] overall
+        // outside spatial mode)
+        double light_probability(const node& leaf, uint32_t i) const;
+
+    private:
+        std::vector<shared_ptr<hittable>> lights;    // in BVH order
+        std::vector<double> light_power;
+        std::vector<double> selection;               // uniform/power: probability of every light
+        alias_table table;
+        std::vector<node> nodes;
+        aabb box;
+};
+
+light_sampler::light_sampler(const hittable_list& src, light_sampling _mode, std::vector<double> powers)
+    : mode(_mode) {
+    if (src.objects.empty()) return;
+    if (!powers.empty() && powers.size() != src.objects.size()) {
+        std::cerr << "ERROR: " << powers.size() << " light powers for " << src.objects.size() << " lights.\n";
+        exit(1);
+    }
+
+    // One light per leaf unless they can't be told apart by their centroids
+    bvh_builder builder(src.objects, 0, src.objects.size(), 0, 1, 1);
+
+    for (const auto& info : builder.prims) {
+        const auto& light = src.objects[info.index];
+        lights.push_back(light);
+        double power = powers.empty()? light->surface_area() : powers[info.index];
+        if (powers.empty() && !(power > 0)) {
+            // Otherwise it would never be picked in power and spatial mode
+            power = info.box.surface_area();
+            if (mode != light_sampling::uniform)
+                std::cerr << "Light " << info.index << " has no surface area, weighting it by its bounding box.\n";
+        }
+        light_power.push_back(fmax(power, 0.0));
+    }
+
+    std::vector<double> weights = light_power;
+    if (mode == light_sampling::uniform) weights.assign(lights.size(), 1.0);
+    table = alias_table(weights);
+    selection.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) selection[i] = table.pmf(i);
+
+    // Same shape as the builder's tree, with the powers summed up from the leaves
+    nodes.resize(builder.nodes.size());
+    for (int i = static_cast<int>(builder.nodes.size())-1; i >= 0; i--) {
+        const auto& b = builder.nodes[i];
+        auto& n = nodes[i];
+        n.box = b.box;
+        n.left = b.left;
+        n.right = b.right;
+        n.first = static_cast<uint32_t>(b.first);
+        n.count = static_cast<uint32_t>(b.count);
+        if (n.is_leaf()) {
+            n.power = 0;
+            for (uint32_t k = n.first; k < n.first+n.count; k++) n.power += light_power[k];
+        } else {
+            // Children always come after their parent in the builder's nodes
+            n.power = nodes[n.left].power + nodes[n.right].power;
+        }
+    }
+    box = nodes[0].box;
+}
+
+double light_sampler::importance(const node& n, const point3& o) const {
+    const point3 center = 0.5*(n.box.min()+n.box.max());
+    const double half_diagonal2 = 0.25*(n.box.max()-n.box.min()).length_squared();
+    // Clamped at the box's own size, a point inside or next to it would blow up otherwise
+    return n.power / fmax((center-o).length_squared(), half_diagonal2);
+}
+
+double light_sampler::left_probability(const node& n, const point3& o) const {
+    const double l = importance(nodes[n.left], o), r = importance(nodes[n.right], o);
+    return l+r > 0? l/(l+r) : 0.5;
+}
+
+double light_sampler::light_probability(const node& leaf, uint32_t i) const {
+    if (mode != light_sampling::spatial) return selection[i];
+    return leaf.power > 0? light_power[i]/leaf.power : 1.0/leaf.count;
+}
+
+bool light_sampler::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    for (const auto& light : lights) {
+        if (light->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+        }
+    }
+    return hit_anything;
+}
+
+double light_sampler::pdf_value(const point3& o, const vec3& v) const {
+    // No lights: random() samples the sphere of directions
+    if (nodes.empty()) return 0.25/pi;
+
+    const ray r(o, v);
+    struct entry {
+        int index;
+        double probability;
+    };
+    entry stack[128];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 1.0};
+
+    double sum = 0;
+    while (stack_size > 0) {
+        const entry e = stack[--stack_size];
+        const auto& n = nodes[e.index];
+        if (!n.box.hit(r, ray_epsilon, infinity)) continue;
+
+        if (n.is_leaf()) {
+            const double p_leaf = mode == light_sampling::spatial? e.probability : 1.0;
+            for (uint32_t i = n.first; i < n.first+n.count; i++) {
+                const double p = p_leaf*light_probability(n, i);
+                if (p > 0) sum += p*lights[i]->pdf_value(o, v);
+            }
+            continue;
+        }
+
+        double p_left = 0.5;
+        if (mode == light_sampling::spatial) p_left = left_probability(n, o);
+        if (stack_size+2 > 128) {
+            std::cerr << "ERROR: light BVH deeper than the pdf_value stack.\n";
+            exit(1);
+        }
+        stack[stack_size++] = {n.left, e.probability*p_left};
+        stack[stack_size++] = {n.right, e.probability*(1-p_left)};
+    }
+    return sum;
+}
+
+vec3 light_sampler::random(const point3& o) const {
+    if (nodes.empty()) return random_unit_vector();
+
+    if (mode != light_sampling::spatial)
+        return lights[table.sample()]->random(o);
+
+    int index = 0;
+    while (!nodes[index].is_leaf()) {
+        const auto& n = nodes[index];
+        index = random_double() < left_probability(n, o)? n.left : n.right;
+    }
+
+    const auto& leaf = nodes[index];
+    uint32_t i = leaf.first;
+    if (leaf.count > 1) {
+        double u = random_double();
+        for (; i < leaf.first+leaf.count-1; i++) {
+            u -= light_probability(leaf, i);
+            if (u < 0) break;
+        }
+    }
+    return lights[i]->random(o);
+}
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+// Flattened BVH, see
+// https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies#CompactBVHForTraversal
+// Nodes are stored depth first, so the first child of an interior node always
+// directly follows it and only the second child's offset is stored. Bounds are
+// floats (rounded outwards) to keep a node at 32 bytes, two per cache line.
+struct alignas(32) linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    union {
+        int32_t primitives_offset;   // leaf
+        int32_t second_child_offset; // interior
+    };
+    uint16_t n_primitives;           // 0 for interior nodes
+    uint8_t axis;                    // split axis of interior nodes
+    uint8_t pad;
+
+    bool is_leaf() const {return n_primitives > 0;}
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
+
+// Pending nodes during traversal, max_sah_depth keeps trees well below this
+const int linear_bvh_stack_size = 128;
+
+inline float round_down(double x) {
+    auto f = static_cast<float>(x);
+    return (static_cast<double>(f) > x)? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x) {
+    auto f = static_cast<float>(x);
+    return (static_cast<double>(f) < x)? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+inline int flatten_bvh(const bvh_builder& builder, int build_index, std::vector<linear_bvh_node>& out) {
+    const auto& node = builder.nodes[build_index];
+    int offset = static_cast<int>(out.size());
+    out.emplace_back();
+
+    auto& lnode = out[offset];
+    for (int a = 0; a < 3; a++) {
+        lnode.bounds_min[a] = round_down(node.box.min()[a]);
+        lnode.bounds_max[a] = round_up(node.box.max()[a]);
+    }
+    lnode.pad = 0;
+
+    if (node.is_leaf()) {
+        lnode.primitives_offset = static_cast<int32_t>(node.first);
+        lnode.n_primitives = static_cast<uint16_t>(node.count);
+        lnode.axis = 0;
+        return offset;
+    }
+
+    lnode.n_primitives = 0;
+    lnode.axis = static_cast<uint8_t>(node.axis);
+    flatten_bvh(builder, node.left, out);
+    int second = flatten_bvh(builder, node.right, out);
+    out[offset].second_child_offset = second;
+    return offset;
+}
+
+inline std::vector<linear_bvh_node> flatten_bvh(const bvh_builder& builder) {
+    std::vector<linear_bvh_node> out;
+    if (builder.nodes.empty()) return out;
+    out.reserve(builder.nodes.size());
+    flatten_bvh(builder, 0, out);
+    return out;
+}
+
+// Ray data that is constant over a whole traversal.
+struct bvh_traversal_ray {
+    bvh_traversal_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = r.orig[a];
+            inv_dir[a] = r.inv_direction()[a];
+            dir_is_neg[a] = r.sign[a];
+        }
+    }
+
+    double origin[3];
+    double inv_dir[3];
+    bool dir_is_neg[3];
+};
+
+inline bool node_hit(const linear_bvh_node& node, const bvh_traversal_ray& tr, double t_min, double t_max) {
+    for (int a = 0; a < 3; a++) {
+        double t0 = (node.bounds_min[a] - tr.origin[a]) * tr.inv_dir[a];
+        double t1 = (node.bounds_max[a] - tr.origin[a]) * tr.inv_dir[a];
+        if (tr.dir_is_neg[a]) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min) return false;
+    }
+    return true;
+}
+
+// Walks the nodes with an explicit stack, nearer child first. leaf_hit(first, count, t_max)
+// intersects a primitive range and returns true (shrinking t_max) on a closer hit, which
+// then culls every node further away than that. With any_hit the walk stops at the first
+// leaf that reports a hit, for shadow rays.
+template <bool any_hit = false, typename leaf_hit_fn>
+bool traverse_linear_bvh(const linear_bvh_node* nodes, const ray& r, double t_min, double t_max,
+        leaf_hit_fn&& leaf_hit) {
+    bvh_traversal_ray tr(r);
+
+    int stack[linear_bvh_stack_size];
+    int stack_size = 0;
+    int current = 0;
+    bool hit_anything = false;
+
+    while (true) {
+        const auto& node = nodes[current];
+        if (node_hit(node, tr, t_min, t_max)) {
+            if (node.is_leaf()) {
+                if (leaf_hit(node.primitives_offset, node.n_primitives, t_max)) {
+                    if (any_hit) return true;
+                    hit_anything = true;
+                }
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            } else if (tr.dir_is_neg[node.axis]) {
+                stack[stack_size++] = current+1;
+                current = node.second_child_offset;
+            } else {
+                stack[stack_size++] = node.second_child_offset;
+                current = current+1;
+            }
+        } else {
+            if (stack_size == 0) break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+class linear_bvh: public hittable {
+    public:
+        static const size_t max_leaf_size = 4;
+
+        linear_bvh() {}
+        linear_bvh(const hittable_list& list, double time0, double time1):
+            linear_bvh(list.objects, time0, time1) {}
+        linear_bvh(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+    public:
+        // Reordered so that every leaf references a contiguous range
+        std::vector<shared_ptr<hittable>> primitives;
+        std::vector<linear_bvh_node> nodes;
+        aabb box;
+        bvh_build_stats build_stats;
+};
+
+linear_bvh::linear_bvh(const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1) {
+    bvh_builder builder(src_objects, 0, src_objects.size(), time0, time1, max_leaf_size);
+    if (builder.nodes.empty()) {
+        std::cerr << "Empty object list in linear_bvh constructor.\n";
+        return;
+    }
+
+    primitives.reserve(builder.prims.size());
+    for (const auto& info : builder.prims)
+        primitives.push_back(src_objects[info.index]);
+
+    nodes = flatten_bvh(builder);
+    box = builder.nodes[0].box;
+    build_stats = builder.stats;
+}
+
+bool linear_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty()) return false;
+
+    return traverse_linear_bvh(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double& closest) {
+            bool hit_leaf = false;
+            for (int i = first; i < first+count; i++) {
+                if (primitives[i]->hit(r, t_min, closest, rec)) {
+                    hit_leaf = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_leaf;
+        });
+}
+
+bool linear_bvh::occluded(const ray& r, double t_min, double t_max) const {
+    if (nodes.empty()) return false;
+
+    return traverse_linear_bvh<true>(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double&) {
+            for (int i = first; i < first+count; i++)
+                if (primitives[i]->occluded(r, t_min, t_max)) return true;
+            return false;
+        });
+}
+
+#endif
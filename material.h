@@ -12,7 +12,9 @@ struct scatter_record {
     ray specular_ray;
     bool is_specular;
     color attenuation;
-    shared_ptr<pdf> pdf_ptr;
+    // Sampling pdf of non-specular scattering, held by value so scattering never allocates.
+    // All diffuse materials so far scatter with a cosine lobe around some direction.
+    cosine_pdf diffuse_pdf;
 };
 
 class material{
@@ -35,7 +37,7 @@ class material{
 
 class lambertian: public material{
     public:
-        lambertian(const color& a): albedo(make_shared<solid_color>(a)){}
+        lambertian(const color& a): albedo(make_pooled<solid_color>(a)){}
         lambertian(shared_ptr<texture> a ): albedo(a) {}
 
         virtual bool scatter(
@@ -43,7 +45,7 @@ class lambertian: public material{
         ) const override {
             srec.is_specular = false;
             srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-            srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+            srec.diffuse_pdf = cosine_pdf(rec.normal);
             return true;
         }
         double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
@@ -59,7 +61,7 @@ class lambertian: public material{
 class diffuse_light: public material {
     public:
         diffuse_light(shared_ptr<texture> a): emit(a) {}
-        diffuse_light(color c): emit(make_shared<solid_color>(c)) {}
+        diffuse_light(color c): emit(make_pooled<solid_color>(c)) {}
 
         virtual bool scatter(const ray& r_in, const hit_record&, scatter_record& srec) const override {return false;}
 
@@ -86,8 +88,6 @@ class metal: public material {
 
             srec.is_specular = true;
             srec.specular_ray = ray(rec.p, reflected+fuzz*random_in_unit_sphere(), ray_in.time());
-
-            srec.pdf_ptr = 0;
             return true;
         }
     public:
@@ -109,8 +109,6 @@ class glossy: public material {
             srec.is_specular = true;
             double fuzz_factor = (fuzz->value(rec.u, rec.v, rec.p)).length();
             srec.specular_ray = ray(rec.p, reflected+fuzz_factor*random_in_unit_sphere(), ray_in.time());
-
-            srec.pdf_ptr = 0;
             return true;
         }
     public:
@@ -125,7 +123,6 @@ class dielectric: public material {
             const ray& ray_in, const hit_record& rec, scatter_record& srec
         ) const override {
             srec.is_specular = true;
-            srec.pdf_ptr = nullptr;
             srec.attenuation = color(1, 1, 1);
 
             double refraction_ratio = rec.front_face? (1.0/ir):ir;
@@ -160,7 +157,7 @@ class dielectric: public material {
 
 class isotropic: public material {
     public:
-        isotropic(color c): albedo(make_shared<solid_color>(c)) {}
+        isotropic(color c): albedo(make_pooled<solid_color>(c)) {}
         isotropic(shared_ptr<texture> a): albedo(a) {}
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override {
@@ -200,11 +197,11 @@ class mixed: public material{
         double ratio;
 
     private:
-        inline shared_ptr<material> choose_mat() const {
+        inline const material* choose_mat() const {
             if (random_double() < ratio){
-                return mat_a;
+                return mat_a.get();
             } else {
-                return mat_b;
+                return mat_b.get();
             }
         }
 };
@@ -234,11 +231,11 @@ class mtl_material: public material {
             diffuse_text(diffuse_a), 
             specular_text(specular_a), 
             transparency_text(transparency_map), 
-            roughness_text(make_shared<roughness_from_sharpness_texture>(sharpness_map, 1, 10000))
+            roughness_text(make_pooled<roughness_from_sharpness_texture>(sharpness_map, 1, 10000))
         {
-            diffuse_mat = make_shared<lambertian>(diffuse_text);
-            specular_mat = make_shared<glossy>(specular_text, roughness_text);
-            emissive_mat = make_shared<diffuse_light>(emissive_text);
+            diffuse_mat = make_pooled<lambertian>(diffuse_text);
+            specular_mat = make_pooled<glossy>(specular_text, roughness_text);
+            emissive_mat = make_pooled<diffuse_light>(emissive_text);
         }
 
         virtual bool scatter(
@@ -287,11 +284,11 @@ class mtl_material: public material {
             return diff / (diff+spec+0.00001);
         }
 
-        inline shared_ptr<material> choose_mat(double u, double v, const point3& p) const {
+        inline const material* choose_mat(double u, double v, const point3& p) const {
             if (diffuse_prob(u, v, p) > random_double()){
-                return diffuse_mat;
+                return diffuse_mat.get();
             } else {
-                return specular_mat;
+                return specular_mat.get();
             }
         }
 };
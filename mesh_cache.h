@@ -0,0 +1,390 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "rtweekend.h"
+
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary cache of a loaded model: the triangulated mesh in BVH order, its finished 4-wide
+// BVH and the mtl material parameters. The file is mmap'ed and the mesh's views point
+// straight into it, so loading one costs a stat, an open and an mmap; pages are read
+// in as rays first touch them.
+//
+// Layout: a mesh_cache_header, then one section per array, each 64 byte aligned (as
+// bvh4_node needs). Everything is in host byte order, the magic, version and node size
+// make any other build or layout reject the file rather than misread it.
+//
+// The cache is tied to its source by size and modification time. If the time changed
+// but the size didn't (a copy, a touch, a checkout), the source's content hash decides.
+// The .mtl files the source asked for are stamped the same way (a missing one too, in
+// case it turns up later), so editing a material also rebuilds the cache.
+//
+// Before the mesh is handed out every index and BVH node is checked against the array
+// it points into, so a damaged cache is rebuilt instead of read out of bounds.
+
+const uint32_t mesh_cache_version = 2;
+
+// Material parameters mtl_material is made from, see get_mtl_mat
+struct mesh_material_params {
+    double diffuse[3];
+    double specular[3];
+    double emission[3];
+    double transmittance[3];
+    double dissolve;
+    double shininess;
+    int32_t illum;
+    int32_t pad;
+};
+
+struct mesh_source_stamp {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t hash = 0;
+};
+
+// A .mtl file named by the source, as the loader looked for it
+struct mesh_mtl_file {
+    char path[240];
+    int32_t exists;
+    int32_t pad;
+    mesh_source_stamp stamp;
+};
+
+enum mesh_cache_section_id {
+    section_positions, section_normals, section_uvs,
+    section_vertex_indices, section_normal_indices, section_uv_indices,
+    section_material_ids, section_nodes, section_materials, section_mtl_files,
+    section_count
+};
+
+struct mesh_cache_section {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    mesh_source_stamp source;
+    uint32_t shade_smooth;
+    uint32_t pad;
+    double box_min[3];
+    double box_max[3];
+    uint64_t stats_node_count;
+    uint64_t stats_leaf_count;
+    int64_t stats_max_depth;
+    double stats_sah_cost;
+    mesh_cache_section sections[section_count];
+};
+
+static const char mesh_cache_magic[8] = {'R', 'I', 'O', 'W', 'M', 'S', 'H', '\0'};
+
+inline std::string mesh_cache_path(const std::string& source_path, bool shade_smooth) {
+    return source_path + (shade_smooth? ".smooth" : ".flat") + ".riowcache";
+}
+
+// 64 bit hash of a file's contents, a word at a time. Returns false if it can't be read.
+inline bool hash_file(const std::string& path, uint64_t& hash) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    std::vector<unsigned char> chunk(1 << 20);
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    size_t n;
+    while ((n = fread(chunk.data(), 1, chunk.size(), file)) > 0) {
+        size_t i = 0;
+        for (; i+8 <= n; i += 8) {
+            uint64_t word;
+            memcpy(&word, &chunk[i], 8);
+            h = rotl64(h ^ word, 29) * 0xbf58476d1ce4e5b9ULL;
+        }
+        for (; i < n; i++) h = rotl64(h ^ chunk[i], 29) * 0xbf58476d1ce4e5b9ULL;
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+
+    uint64_t state = h;
+    hash = splitmix64(state);
+    return ok;
+}
+
+// Size and modification time only, the hash is only computed when it's needed
+inline bool stat_source(const std::string& path, mesh_source_stamp& stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    stamp.size = static_cast<uint64_t>(st.st_size);
+    stamp.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+    stamp.hash = 0;
+    return true;
+}
+
+// Stamp of a .mtl file with its hash, or a missing one
+inline bool stamp_mtl_file(const std::string& path, mesh_mtl_file& out) {
+    if (path.size() >= sizeof(out.path)) return false;
+    out = mesh_mtl_file{};
+    memcpy(out.path, path.c_str(), path.size());
+    out.exists = stat_source(path, out.stamp) && hash_file(path, out.stamp.hash);
+    return true;
+}
+
+// True if every .mtl file is as it was when the cache was written
+inline bool mtl_files_unchanged(const mesh_mtl_file* files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        mesh_mtl_file recorded = files[i];
+        recorded.path[sizeof(recorded.path)-1] = '\0';
+        mesh_source_stamp now;
+        const bool exists = stat_source(recorded.path, now);
+        if (exists != (recorded.exists != 0)) return false;
+        if (!exists) continue;
+        if (now.size != recorded.stamp.size) return false;
+        if (now.mtime_ns != recorded.stamp.mtime_ns
+                && (!hash_file(recorded.path, now.hash) || now.hash != recorded.stamp.hash)) return false;
+    }
+    return true;
+}
+
+// Checks that the mesh only refers to what is in its arrays: vertex, normal and uv indices
+// below their counts, material ids at most material_count (the fallback material), BVH
+// children after their parent (so traversal ends) and leaf ranges within the faces.
+// Runs once over the whole mapping, traversal and hit_face trust it from then on.
+inline bool mesh_in_bounds(const triangle_mesh& mesh, size_t material_count) {
+    const size_t n_faces = mesh.material_ids.size();
+    if (mesh.positions.size() % 3 != 0 || mesh.normals.size() % 3 != 0 || mesh.uvs.size() % 2 != 0)
+        return false;
+    if (mesh.vertex_indices.size() != 3*n_faces
+            || (!mesh.normal_indices.empty() && mesh.normal_indices.size() != 3*n_faces)
+            || (!mesh.uv_indices.empty() && mesh.uv_indices.size() != 3*n_faces)
+            || n_faces > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+        return false;
+
+    // Faces without normals or uvs only have no_index in their first corner's slot
+    auto corners_in_bounds = [&](const array_view<uint32_t>& indices, size_t count, bool optional) {
+        for (size_t f = 0; f < indices.size()/3; f++) {
+            if (optional && indices[3*f] == triangle_mesh::no_index) continue;
+            for (size_t k = 0; k < 3; k++)
+                if (indices[3*f+k] >= count) return false;
+        }
+        return true;
+    };
+    if (!corners_in_bounds(mesh.vertex_indices, mesh.positions.size()/3, false)
+            || !corners_in_bounds(mesh.normal_indices, mesh.normals.size()/3, true)
+            || !corners_in_bounds(mesh.uv_indices, mesh.uvs.size()/2, true))
+        return false;
+    for (size_t f = 0; f < n_faces; f++)
+        if (mesh.material_ids[f] > material_count) return false;
+
+    if (mesh.nodes.empty()) return n_faces == 0;
+    // traverse_bvh4 keeps at most 3 entries per level plus one on its stack
+    const int max_depth = (bvh4_stack_size-1) / 3;
+    std::vector<int> depth(mesh.nodes.size(), 0);
+    depth[0] = 1;
+    for (size_t i = 0; i < mesh.nodes.size(); i++) {
+        const auto& node = mesh.nodes[i];
+        if (depth[i] == 0) continue;    // unreachable
+        if (node.n_children > 4 || depth[i] > max_depth) return false;
+        for (int c = 0; c < 4; c++) {
+            if (c >= node.n_children) {
+                // Unused lanes have inverted boxes, nothing may enter them
+                if (!(node.bounds_min[0][c] > node.bounds_max[0][c])) return false;
+                continue;
+            }
+            const int32_t child = node.child[c];
+            if (node.count[c] > 0) {
+                if (child < 0 || static_cast<size_t>(child) + node.count[c] > n_faces) return false;
+            } else {
+                if (child <= static_cast<int32_t>(i) || static_cast<size_t>(child) >= mesh.nodes.size())
+                    return false;
+                depth[static_cast<size_t>(child)] = std::max(depth[static_cast<size_t>(child)], depth[i]+1);
+            }
+        }
+    }
+    return true;
+}
+
+// Maps cache_path and returns a mesh that reads from it, or nullptr if there is no
+// usable cache for source. The caller fills in mesh->materials from mtls.
+shared_ptr<triangle_mesh> load_mesh_cache(const std::string& cache_path, const std::string& source_path,
+        const mesh_source_stamp& source, bool shade_smooth, std::vector<mesh_material_params>& mtls) {
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(mesh_cache_header)) {
+        close(fd);
+        return nullptr;
+    }
+    const auto file_size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+
+    shared_ptr<const void> backing(addr, [file_size](const void* p) {
+        munmap(const_cast<void*>(p), file_size);
+    });
+    const auto* base = static_cast<const unsigned char*>(addr);
+    const auto* header = static_cast<const mesh_cache_header*>(addr);
+
+    if (memcmp(header->magic, mesh_cache_magic, 8) != 0 || header->version != mesh_cache_version
+            || header->node_size != sizeof(bvh4_node) || header->shade_smooth != (shade_smooth? 1u:0u)) {
+        std::cerr << "Mesh cache '" << cache_path << "' is from another version, rebuilding it.\n";
+        return nullptr;
+    }
+
+    if (header->source.size != source.size) return nullptr;
+    mesh_source_stamp refreshed = source;
+    const bool touched = header->source.mtime_ns != source.mtime_ns;
+    if (touched && (!hash_file(source_path, refreshed.hash) || refreshed.hash != header->source.hash))
+        return nullptr;
+
+    const size_t element_size[section_count] = {
+        sizeof(float), sizeof(float), sizeof(float),
+        sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+        sizeof(uint16_t), sizeof(bvh4_node), sizeof(mesh_material_params), sizeof(mesh_mtl_file)
+    };
+    for (int s = 0; s < section_count; s++) {
+        const auto& section = header->sections[s];
+        if (section.offset % 64 != 0 || section.offset > file_size
+                || section.count > (file_size - section.offset) / element_size[s]) {
+            std::cerr << "Mesh cache '" << cache_path << "' is truncated, rebuilding it.\n";
+            return nullptr;
+        }
+    }
+
+    auto view = [&](int s) {return base + header->sections[s].offset;};
+    auto count = [&](int s) {return static_cast<size_t>(header->sections[s].count);};
+
+    if (!mtl_files_unchanged(reinterpret_cast<const mesh_mtl_file*>(view(section_mtl_files)), count(section_mtl_files)))
+        return nullptr;
+
+    auto mesh = make_shared<triangle_mesh>(backing, std::vector<shared_ptr<material>>());
+    mesh->positions = array_view<float>(reinterpret_cast<const float*>(view(section_positions)), count(section_positions));
+    mesh->normals = array_view<float>(reinterpret_cast<const float*>(view(section_normals)), count(section_normals));
+    mesh->uvs = array_view<float>(reinterpret_cast<const float*>(view(section_uvs)), count(section_uvs));
+    mesh->vertex_indices = array_view<uint32_t>(
+        reinterpret_cast<const uint32_t*>(view(section_vertex_indices)), count(section_vertex_indices));
+    mesh->normal_indices = array_view<uint32_t>(
+        reinterpret_cast<const uint32_t*>(view(section_normal_indices)), count(section_normal_indices));
+    mesh->uv_indices = array_view<uint32_t>(
+        reinterpret_cast<const uint32_t*>(view(section_uv_indices)), count(section_uv_indices));
+    mesh->material_ids = array_view<uint16_t>(
+        reinterpret_cast<const uint16_t*>(view(section_material_ids)), count(section_material_ids));
+    mesh->nodes = array_view<bvh4_node>(reinterpret_cast<const bvh4_node*>(view(section_nodes)), count(section_nodes));
+
+    mesh->box = aabb(point3(header->box_min[0], header->box_min[1], header->box_min[2]),
+                     point3(header->box_max[0], header->box_max[1], header->box_max[2]));
+    mesh->build_stats.node_count = header->stats_node_count;
+    mesh->build_stats.leaf_count = header->stats_leaf_count;
+    mesh->build_stats.max_depth = static_cast<int>(header->stats_max_depth);
+    mesh->build_stats.sah_cost = header->stats_sah_cost;
+
+    if (!mesh_in_bounds(*mesh, count(section_materials))) {
+        std::cerr << "Mesh cache '" << cache_path << "' is damaged, rebuilding it.\n";
+        return nullptr;
+    }
+
+    if (touched) {
+        // Same contents, store the new time so the next run doesn't hash it again
+        int wfd = open(cache_path.c_str(), O_WRONLY);
+        if (wfd >= 0) {
+            if (pwrite(wfd, &refreshed, sizeof(refreshed), offsetof(mesh_cache_header, source)) < 0)
+                std::cerr << "Couldn't update mesh cache '" << cache_path << "'.\n";
+            close(wfd);
+        }
+    }
+
+    const auto* mtl = reinterpret_cast<const mesh_material_params*>(view(section_materials));
+    mtls.assign(mtl, mtl + count(section_materials));
+    return mesh;
+}
+
+// Writes the cache next to a temporary name and renames it into place, so a reader never
+// sees half a file. A failure only costs the next run a reload, so it isn't fatal.
+bool save_mesh_cache(const std::string& cache_path, const std::string& source_path,
+        mesh_source_stamp source, bool shade_smooth,
+        const triangle_mesh& mesh, const std::vector<mesh_material_params>& mtls,
+        const std::vector<mesh_mtl_file>& mtl_files) {
+    if (!hash_file(source_path, source.hash)) return false;
+
+    mesh_cache_header header{};
+    memcpy(header.magic, mesh_cache_magic, 8);
+    header.version = mesh_cache_version;
+    header.node_size = sizeof(bvh4_node);
+    header.source = source;
+    header.shade_smooth = shade_smooth? 1:0;
+    for (int a = 0; a < 3; a++) {
+        header.box_min[a] = mesh.box.min()[a];
+        header.box_max[a] = mesh.box.max()[a];
+    }
+    header.stats_node_count = mesh.build_stats.node_count;
+    header.stats_leaf_count = mesh.build_stats.leaf_count;
+    header.stats_max_depth = mesh.build_stats.max_depth;
+    header.stats_sah_cost = mesh.build_stats.sah_cost;
+
+    struct section_data {
+        const void* data;
+        size_t count;
+        size_t element_size;
+    } sections[section_count] = {
+        {mesh.positions.data(), mesh.positions.size(), sizeof(float)},
+        {mesh.normals.data(), mesh.normals.size(), sizeof(float)},
+        {mesh.uvs.data(), mesh.uvs.size(), sizeof(float)},
+        {mesh.vertex_indices.data(), mesh.vertex_indices.size(), sizeof(uint32_t)},
+        {mesh.normal_indices.data(), mesh.normal_indices.size(), sizeof(uint32_t)},
+        {mesh.uv_indices.data(), mesh.uv_indices.size(), sizeof(uint32_t)},
+        {mesh.material_ids.data(), mesh.material_ids.size(), sizeof(uint16_t)},
+        {mesh.nodes.data(), mesh.nodes.size(), sizeof(bvh4_node)},
+        {mtls.data(), mtls.size(), sizeof(mesh_material_params)},
+        {mtl_files.data(), mtl_files.size(), sizeof(mesh_mtl_file)},
+    };
+
+    auto align = [](uint64_t offset) {return (offset + 63) & ~uint64_t(63);};
+    uint64_t offset = align(sizeof(header));
+    for (int s = 0; s < section_count; s++) {
+        header.sections[s].offset = offset;
+        header.sections[s].count = sections[s].count;
+        offset = align(offset + sections[s].count*sections[s].element_size);
+    }
+
+    auto tmp_path = cache_path + ".tmp" + std::to_string(getpid());
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) return false;
+
+    const unsigned char zeros[64] = {};
+    uint64_t written = 0;
+    auto put = [&](const void* data, size_t bytes) {
+        bool ok = bytes == 0 || fwrite(data, 1, bytes, file) == bytes;
+        written += bytes;
+        return ok;
+    };
+    auto pad_to = [&](uint64_t target) {return put(zeros, static_cast<size_t>(target - written));};
+
+    bool ok = put(&header, sizeof(header));
+    for (int s = 0; s < section_count && ok; s++) {
+        ok = pad_to(header.sections[s].offset)
+            && put(sections[s].data, sections[s].count*sections[s].element_size);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
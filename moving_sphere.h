@@ -17,6 +17,10 @@ class moving_sphere : public hittable {
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double root;
+            return nearest_root(r, t_min, t_max, root);
+        }
         virtual bool bounding_box(double _time0, double _time1, aabb &output_box) const override;
 
         point3 center(double time) const;
@@ -26,13 +30,16 @@ class moving_sphere : public hittable {
         double time0, time1;
         double radius;
         shared_ptr<material> mat_ptr;
+
+    private:
+        bool nearest_root(const ray& r, double t_min, double t_max, double& root) const;
 };
 
 point3 moving_sphere::center(double time) const {
     return center0 + ((time - time0) / (time1 - time0))*(center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool moving_sphere::nearest_root(const ray& r, double t_min, double t_max, double& root) const {
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -43,18 +50,24 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double root;
+    if (!nearest_root(r, t_min, t_max, root)) return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     return true;
 }
@@ -5,6 +5,10 @@
 #include "onb.h"
 #include "hittable.h"
 #include "texture.h"
+#include "alias_table.h"
+
+#include <algorithm>
+#include <vector>
 
 class pdf {
     public: 
@@ -27,6 +31,7 @@ inline vec3 random_cosine_direction() {
 
 class cosine_pdf: public pdf {
     public: 
+        cosine_pdf() {}
         cosine_pdf(const vec3& w){uvw.build_from_w(w);}
 
         virtual double value(const vec3& direction) const override {
@@ -42,9 +47,25 @@ class cosine_pdf: public pdf {
         onb uvw;
 };
 
+// Uniform over all directions
+class sphere_pdf: public pdf {
+    public:
+        sphere_pdf() {}
+
+        virtual double value(const vec3& direction) const override {
+            return 0.25/pi;
+        }
+
+        virtual vec3 generate() const override {
+            return random_unit_vector();
+        }
+};
+
+// The pdfs below only reference the objects they are built from, so they can live
+// on the stack for a single bounce without any allocations or refcounting.
 class hittable_pdf: public pdf {
     public:
-        hittable_pdf(shared_ptr<hittable> p, const point3& origin): ptr(p), o(origin) {}
+        hittable_pdf(const hittable& p, const point3& origin): ptr(&p), o(origin) {}
 
         virtual double value(const vec3& direction) const override {
             return ptr->pdf_value(o, direction);
@@ -54,14 +75,14 @@ class hittable_pdf: public pdf {
             return ptr->random(o);
         }
     public:
-        shared_ptr<hittable> ptr;
+        const hittable* ptr;
         point3 o;
 };
 
 class mixture_pdf: public pdf {
     public:
-        mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1): proportion(0.5) {p[0] = p0; p[1] = p1;}
-        mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1, double prop): proportion(prop) {p[0] = p0; p[1] = p1;}
+        mixture_pdf(const pdf& p0, const pdf& p1): proportion(0.5) {p[0] = &p0; p[1] = &p1;}
+        mixture_pdf(const pdf& p0, const pdf& p1, double prop): proportion(prop) {p[0] = &p0; p[1] = &p1;}
         
         virtual double value(const vec3& direction) const override {
             return proportion*(p[0]->value(direction)) + (1.0-proportion)*(p[1]->value(direction));
@@ -76,7 +97,7 @@ class mixture_pdf: public pdf {
         }
     public:
         double proportion;
-        shared_ptr<pdf> p[2];
+        const pdf* p[2];
 };
 
 inline vec3 random_to_sphere(double radius, double distance_squared){
@@ -92,89 +113,59 @@ inline vec3 random_to_sphere(double radius, double distance_squared){
     return vec3(x, y, z);
 }
 
+// Samples the environment map by texel, in proportion to luminance times the solid angle
+// the texel covers, then uniformly in (u, v) within the texel. Texels are drawn from an
+// alias table and their pdfs are tabulated, so generate() and value() are constant time.
+//
+// A texel spans du = 1/W, dv = 1/H of the lat-long map, and dw = 2*pi^2 sin(theta) du dv,
+// so a texel drawn with probability P has the direction pdf P*W*H / (2*pi^2 sin(theta)).
 class image_pdf: public pdf {
-    // From http://igorsklyar.com/system/documents/papers/4/fiscourse.comp.pdf
     public:
-        image_pdf(shared_ptr<image_texture>& img): 
-            image(img), m_width(img->width), m_height(img->height), m_channels(3), m_pData(img->data)
-        {
-            unsigned int k=0;
-            float angleFrac = M_PI / float(m_height);
-            float theta = angleFrac * 0.5f;
-            float sinTheta = 0.f;
-            float *pSinTheta = (float*) alloca(sizeof(float)*m_height);
-            for (unsigned int i=0; i < m_height; i++, theta += angleFrac) {
-                pSinTheta[i] = sin(theta);
-            }
-            // convert the data into a marginal CDF along the columns
-            pBuffer = (float*) malloc(m_width*(m_height+1)*sizeof(float));
-            pUDist = &pBuffer[m_width*m_height];
-            for (unsigned int i=0,m=0; i < m_width; i++, m+=m_height) {
-                float *pVDist = &pBuffer[m];
-                k = i*m_channels;
-                pVDist[0] = 0.2126f * m_pData[k+0] + 0.7152f * m_pData[k+1] +
-                0.0722f * m_pData[k+2];
-                pVDist[0] *= pSinTheta[0];
-                for (unsigned int j=1,k=(m_width+i)*m_channels; j < m_height; j++, k+=m_width*m_channels) {
-                    float lum = 0.2126f * m_pData[k+0] + 0.7152f * m_pData[k+1] +
-                    0.0722f * m_pData[k+2];
-                    lum *= pSinTheta[j];
-                    pVDist[j] = pVDist[j-1] + lum;
-
-                }
-                if (i == 0) {
-                    pUDist[i] = pVDist[m_height-1];
-                } else {
-                    pUDist[i] = pUDist[i-1] + pVDist[m_height-1];
+        image_pdf(const shared_ptr<image_texture>& img): image(img), width(img->width), height(img->height) {
+            const size_t n = static_cast<size_t>(width)*height;
+            std::vector<double> weights(n);
+            for (int y = 0; y < height; y++) {
+                const double sin_theta = sin(pi*(y+0.5)/height);
+                for (int x = 0; x < width; x++) {
+                    const color c = img->texel(x, y);
+                    const double lum = 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+                    weights[static_cast<size_t>(y)*width+x] = fmax(lum, 0.0)*sin_theta;
                 }
             }
+            texels = alias_table(weights);
+
+            texel_pdf.resize(n);
+            const double norm = static_cast<double>(n) / (2*pi*pi);
+            for (size_t i = 0; i < n; i++)
+                texel_pdf[i] = static_cast<float>(texels.pmf(i)*norm);
         }
 
         virtual double value(const vec3& direction) const override {
-            double _u, _v; get_spherical_uv(unit_vector(direction), _u, _v);
-            _u = 1.-_u;
-            int u = _u*double(m_height-1), v = _v*double(m_width-1);
-            if (u < 0) u = 0;
-            if (u>=m_height) u = m_height-1;
-
-            if (v < 0) v = 0;
-            if (v>=m_width) v = m_width-1;
-
-            float angleFrac = M_PI / float(m_height);
-            float invPdfNorm = (2.f * float(M_PI*M_PI) ) / float(m_width*m_height);
-            float* pVDist = &pBuffer[m_height*u];
-            // compute the actual PDF
-            float pdfU = (u == 0)?(pUDist[0]):(pUDist[u]-pUDist[u-1]);
-            pdfU /= pUDist[m_width-1];
-            float pdfV = (v == 0)?(pVDist[0]):(pVDist[v]-pVDist[v-1]);
-            pdfV /= pVDist[m_height-1];
-            float theta = angleFrac * 0.5 + angleFrac * u;
-            float Pdf = ( pdfU * pdfV ) * sin(theta) /invPdfNorm;
-            
-            return Pdf;
+            const vec3 d = unit_vector(direction);
+            const double sin_theta = sqrt(fmax(0.0, 1 - d.y()*d.y()));
+            if (sin_theta <= 0) return 0;
+
+            double u, v; get_spherical_uv(d, u, v);
+            const int x = std::min(std::max(static_cast<int>(u*width), 0), width-1);
+            const int y = std::min(std::max(static_cast<int>((1-v)*height), 0), height-1);
+            return texel_pdf[static_cast<size_t>(y)*width+x] / sin_theta;
         }
 
         virtual vec3 generate() const override {
-            double r1=random_double(), r2=random_double();
-
-            float maxUVal = pUDist[m_width-1];
-            float* pUPos = std::lower_bound(pUDist, pUDist+m_width,
-            r1 * maxUVal);
-            int u = pUPos - pUDist;
-            float* pVDist = &pBuffer[m_height*u];
-            float* pVPos = std::lower_bound(pVDist, pVDist+m_height,
-            r2 * pVDist[m_height-1]);
-            int v = pVPos - pVDist;
-
-            double _u=double(u)/m_height, _v=double(v)/m_width;
-            _u = 1.-_u;
-
-            return from_spherical_uv(_u, _v);
+            const size_t k = texels.sample();
+            const auto x = static_cast<int>(k % width), y = static_cast<int>(k / width);
+            const double u = (x+random_double()) / width;
+            const double v = 1 - (y+random_double()) / height; // image rows go top to bottom
+            return from_spherical_uv(u, v);
         }
+
     public:
         shared_ptr<image_texture> image;
-        int m_width, m_height, m_channels;
-        float* m_pData, *pUDist, *pBuffer; 
+        int width, height;
+
+    private:
+        alias_table texels;
+        std::vector<float> texel_pdf;   // P*W*H / (2*pi^2), only the sin(theta) is left to divide by
 };
 
 #endif
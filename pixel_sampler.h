@@ -0,0 +1,70 @@
+#ifndef PIXEL_SAMPLER_H
+#define PIXEL_SAMPLER_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "pdf.h"
+#include "texture.h"
+#include "adaptive_sampling.h"
+
+#include <algorithm>
+#include <vector>
+
+// Camera samples of one pixel with the per-pixel integrators (recursive, iterative, nee).
+// riow's render loop and riow_bench both go through this, so the benchmark renders
+// exactly what riow does with the same options and seed.
+struct pixel_sampler {
+    const camera& cam;
+    int image_width;
+    int image_height;
+    const shared_ptr<texture>& background;
+    const shared_ptr<pdf>& background_pdf;
+    const hittable& world;
+    const shared_ptr<hittable>& lights;
+    integrator_type integrator;
+    int max_depth;
+    int max_depth_iterative;
+    int rr_min_depth;
+
+    color trace(const ray& r) const {
+        color c;
+        if (integrator == integrator_type::iterative)
+            c = ray_color_iterative(r, background, background_pdf, world, lights, max_depth_iterative, rr_min_depth);
+        else if (integrator == integrator_type::nee)
+            c = ray_color_nee(r, background, background_pdf, world, lights, max_depth_iterative, rr_min_depth);
+        else
+            c = ray_color(r, background, background_pdf, world, lights, max_depth);
+        zero_nan_vals(c);
+        return c;
+    }
+
+    // Samples pixel (i, j) until estimate.n reaches pass_end, or, with max_relative_error > 0,
+    // until the estimate has converged. Reseeds from (seed, i, j, pass) and returns the sum
+    // of the new samples. jitter is scratch space for 2*adaptive_batch_size numbers.
+    color sample(int i, int j, uint64_t seed, int pass, int pass_end, pixel_estimate& estimate,
+            int min_spp, double max_relative_error, std::vector<double>& jitter) const {
+        seed_random(hash_seed(seed, i, j, pass));
+
+        color pixel_color(0, 0, 0);
+        while (estimate.n < pass_end) {
+            const int batch = std::min(adaptive_batch_size, pass_end-estimate.n);
+            random_doubles(jitter.data(), 2*static_cast<size_t>(batch));
+
+            for (int b = 0; b < batch; ++b) {
+                auto u = (i+jitter[2*b]) / (image_width-1);
+                auto v = (j+jitter[2*b+1]) / (image_height-1);
+                color c = trace(cam.get_ray(u, v));
+                pixel_color += c;
+                estimate.add(c);
+            }
+
+            if (max_relative_error > 0 && estimate.converged(min_spp, max_relative_error)) break;
+        }
+        return pixel_color;
+    }
+};
+
+#endif
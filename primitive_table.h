@@ -0,0 +1,437 @@
+#ifndef PRIMITIVE_TABLE_H
+#define PRIMITIVE_TABLE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "triangle.h"
+#include "aarect.h"
+#include "box.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+// The primitives of a BVH sorted into one table per type, stored as structure of arrays.
+// A leaf references ranges of these tables, so intersecting it is a tight loop per type
+// over plain numbers instead of a virtual hit() per primitive. Types without a table go
+// to the "other" table, which still calls hit().
+//
+// A range is tested in two steps: a loop that computes the hit distance of every primitive
+// from the columns it needs, then the hit record is filled in only for the closest one.
+// Without a hit record (shadow rays) the second step is skipped.
+// The math is the same as in the primitives' own hit(), so a BVH over the tables finds
+// exactly the same hits as one over the objects.
+enum class primitive_type: uint8_t {sphere, moving_sphere, triangle, xy_rect, xz_rect, yz_rect, other};
+
+// count primitives of one type, from first on in the table of that type
+struct primitive_range {
+    uint32_t first;
+    uint16_t count;
+    primitive_type type;
+};
+
+// Longest range, the leaf size of bvh4
+const int max_range_size = 4;
+
+// Closest primitive that was hit, ties go to the later one like in a loop over hit() calls
+inline int closest_hit(const bool hits[max_range_size], const double t[max_range_size], int count) {
+    int best = -1;
+    for (int k = 0; k < count; k++)
+        if (hits[k] && (best < 0 || t[k] <= t[best])) best = k;
+    return best;
+}
+
+struct sphere_table {
+    std::vector<double> center[3], radius;
+    std::vector<const material*> mat;
+
+    void add(const sphere& s) {
+        for (int a = 0; a < 3; a++) center[a].push_back(s.center[a]);
+        radius.push_back(s.radius);
+        mat.push_back(s.mat_ptr.get());
+    }
+
+    bool hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const;
+};
+
+bool sphere_table::hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const {
+    const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+    const double dx = r.direction().x(), dy = r.direction().y(), dz = r.direction().z();
+    const double a = r.direction().length_squared();
+    const double *cx = &center[0][first], *cy = &center[1][first], *cz = &center[2][first];
+    const double *rad = &radius[first];
+
+    double roots[max_range_size];
+    bool hits[max_range_size];
+    for (int k = 0; k < count; k++) {
+        const double ocx = ox-cx[k], ocy = oy-cy[k], ocz = oz-cz[k];
+        const double half_b = ocx*dx + ocy*dy + ocz*dz;
+        const double c = (ocx*ocx + ocy*ocy + ocz*ocz) - rad[k]*rad[k];
+        const double discriminant = half_b*half_b - a*c;
+        const double sqrtd = sqrt(fabs(discriminant));
+
+        const double near_root = (-half_b - sqrtd) / a;
+        const double far_root = (-half_b + sqrtd) / a;
+        const bool near_ok = !(near_root < t_min || t_max < near_root);
+        const bool far_ok = !(far_root < t_min || t_max < far_root);
+        roots[k] = near_ok? near_root : far_root;
+        hits[k] = discriminant >= 0 && (near_ok || far_ok);
+    }
+
+    const int best = closest_hit(hits, roots, count);
+    if (best < 0) return false;
+    if (!rec) return true;
+
+    const size_t i = first + static_cast<size_t>(best);
+    const point3 cen(center[0][i], center[1][i], center[2][i]);
+    rec->t = roots[best];
+    rec->p = r.at(rec->t);
+    vec3 outward_normal = (rec->p - cen) / radius[i];
+    rec->set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec->u, rec->v);
+    rec->mat_ptr = mat[i];
+    return true;
+}
+
+struct moving_sphere_table {
+    std::vector<double> center0[3], motion[3], time0, duration, radius;
+    std::vector<const material*> mat;
+
+    void add(const moving_sphere& s) {
+        const vec3 delta = s.center1 - s.center0;
+        for (int a = 0; a < 3; a++) {
+            center0[a].push_back(s.center0[a]);
+            motion[a].push_back(delta[a]);
+        }
+        time0.push_back(s.time0);
+        duration.push_back(s.time1 - s.time0);
+        radius.push_back(s.radius);
+        mat.push_back(s.mat_ptr.get());
+    }
+
+    bool hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const;
+};
+
+bool moving_sphere_table::hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const {
+    const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+    const double dx = r.direction().x(), dy = r.direction().y(), dz = r.direction().z();
+    const double a = r.direction().length_squared();
+    const double time = r.time();
+
+    double roots[max_range_size], cx[max_range_size], cy[max_range_size], cz[max_range_size];
+    bool hits[max_range_size];
+    for (int k = 0; k < count; k++) {
+        const size_t i = first + static_cast<size_t>(k);
+        const double s = (time - time0[i]) / duration[i];
+        cx[k] = center0[0][i] + s*motion[0][i];
+        cy[k] = center0[1][i] + s*motion[1][i];
+        cz[k] = center0[2][i] + s*motion[2][i];
+
+        const double ocx = ox-cx[k], ocy = oy-cy[k], ocz = oz-cz[k];
+        const double half_b = ocx*dx + ocy*dy + ocz*dz;
+        const double c = (ocx*ocx + ocy*ocy + ocz*ocz) - radius[i]*radius[i];
+        const double discriminant = half_b*half_b - a*c;
+        const double sqrtd = sqrt(fabs(discriminant));
+
+        const double near_root = (-half_b - sqrtd) / a;
+        const double far_root = (-half_b + sqrtd) / a;
+        const bool near_ok = !(near_root < t_min || t_max < near_root);
+        const bool far_ok = !(far_root < t_min || t_max < far_root);
+        roots[k] = near_ok? near_root : far_root;
+        hits[k] = discriminant >= 0 && (near_ok || far_ok);
+    }
+
+    const int best = closest_hit(hits, roots, count);
+    if (best < 0) return false;
+    if (!rec) return true;
+
+    const size_t i = first + static_cast<size_t>(best);
+    rec->t = roots[best];
+    rec->p = r.at(rec->t);
+    auto outward_normal = (rec->p - point3(cx[best], cy[best], cz[best])) / radius[i];
+    rec->set_face_normal(r, outward_normal);
+    rec->mat_ptr = mat[i];
+    return true;
+}
+
+struct triangle_table {
+    // Only needed for the triangle that was hit
+    struct shading {
+        vec3 vert_normals[3];
+        vec3 face_normal;
+        bool smooth_normals;
+        const material* mat;
+    };
+
+    std::vector<double> v0[3], edge1[3], edge2[3];
+    std::vector<shading> shade;
+
+    void add(const triangle& tri) {
+        const vec3 e1 = tri.verts[1] - tri.verts[0];
+        const vec3 e2 = tri.verts[2] - tri.verts[0];
+        for (int a = 0; a < 3; a++) {
+            v0[a].push_back(tri.verts[0][a]);
+            edge1[a].push_back(e1[a]);
+            edge2[a].push_back(e2[a]);
+        }
+        const auto& v = tri.verts;
+        shade.push_back({{tri.vert_normals[0], tri.vert_normals[1], tri.vert_normals[2]},
+            unit_vector(cross(v[0]-v[1], v[0]-v[2])), tri.smooth_normals, tri.mat_ptr.get()});
+    }
+
+    bool hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const;
+};
+
+// Moller-Trumbore, as in triangle::hit
+bool triangle_table::hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const {
+    const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+    const double dx = r.direction().x(), dy = r.direction().y(), dz = r.direction().z();
+
+    double ts[max_range_size], us[max_range_size], vs[max_range_size], dets[max_range_size];
+    bool hits[max_range_size];
+    for (int k = 0; k < count; k++) {
+        const size_t i = first + static_cast<size_t>(k);
+        const double e1x = edge1[0][i], e1y = edge1[1][i], e1z = edge1[2][i];
+        const double e2x = edge2[0][i], e2y = edge2[1][i], e2z = edge2[2][i];
+
+        const double px = dy*e2z - dz*e2y, py = dz*e2x - dx*e2z, pz = dx*e2y - dy*e2x;
+        const double det = e1x*px + e1y*py + e1z*pz;
+        const double inv_det = 1. / det;
+
+        const double tx = ox-v0[0][i], ty = oy-v0[1][i], tz = oz-v0[2][i];
+        const double u = (tx*px + ty*py + tz*pz)*inv_det;
+        const double qx = ty*e1z - tz*e1y, qy = tz*e1x - tx*e1z, qz = tx*e1y - ty*e1x;
+        const double v = (dx*qx + dy*qy + dz*qz)*inv_det;
+        const double t = (e2x*qx + e2y*qy + e2z*qz)*inv_det;
+
+        ts[k] = t;
+        us[k] = u;
+        vs[k] = v;
+        dets[k] = det;
+        hits[k] = !(fabs(det) < EPS) && !(u < 0 || u > 1)
+                  && !(v < 0 || u + v > 1) && !(t < t_min || t > t_max);
+    }
+
+    const int best = closest_hit(hits, ts, count);
+    if (best < 0) return false;
+    if (!rec) return true;
+
+    const auto& s = shade[first + static_cast<size_t>(best)];
+    const double u = us[best], v = vs[best];
+    rec->t = ts[best];
+    rec->u = u;
+    rec->v = v;
+    rec->p = r.at(rec->t);
+    rec->mat_ptr = s.mat;
+
+    rec->front_face = true;
+    vec3 normal = s.face_normal;
+    if (s.smooth_normals)
+        normal = u*s.vert_normals[1] + v*s.vert_normals[2] + (1-u-v)*s.vert_normals[0];
+    rec->set_face_normal(r, (dets[best] >= -EPS)? normal:-normal);
+    return true;
+}
+
+// Axis aligned rectangles at k on axis n, spanning [a0, a1] on axis a and [b0, b1] on axis b
+template <int n, int a, int b>
+struct rect_table {
+    std::vector<double> k, a0, a1, b0, b1;
+    std::vector<const material*> mat;
+
+    void add(double _a0, double _a1, double _b0, double _b1, double _k, const material* m) {
+        a0.push_back(_a0);
+        a1.push_back(_a1);
+        b0.push_back(_b0);
+        b1.push_back(_b1);
+        k.push_back(_k);
+        mat.push_back(m);
+    }
+
+    bool hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const;
+};
+
+template <int n, int a, int b>
+bool rect_table<n, a, b>::hit(uint32_t first, int count, const ray& r, double t_min, double t_max, hit_record* rec) const {
+    const double on = r.origin()[n], oa = r.origin()[a], ob = r.origin()[b];
+    const double dn = r.direction()[n], da = r.direction()[a], db = r.direction()[b];
+
+    double ts[max_range_size], as[max_range_size], bs[max_range_size];
+    bool hits[max_range_size];
+    for (int j = 0; j < count; j++) {
+        const size_t i = first + static_cast<size_t>(j);
+        const double t = (k[i]-on) / dn;
+        const double x = oa + t*da;
+        const double y = ob + t*db;
+        ts[j] = t;
+        as[j] = x;
+        bs[j] = y;
+        hits[j] = !(t < t_min || t > t_max)
+                  && !(x < a0[i] || x > a1[i] || y < b0[i] || y > b1[i]);
+    }
+
+    const int best = closest_hit(hits, ts, count);
+    if (best < 0) return false;
+    if (!rec) return true;
+
+    const size_t i = first + static_cast<size_t>(best);
+    rec->u = (as[best]-a0[i])/(a1[i]-a0[i]);
+    rec->v = (bs[best]-b0[i])/(b1[i]-b0[i]);
+    rec->t = ts[best];
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[n] = 1;
+    rec->set_face_normal(r, outward_normal);
+    rec->mat_ptr = mat[i];
+    rec->p = r.at(rec->t);
+    return true;
+}
+
+class primitive_tables {
+    public:
+        static primitive_type type_of(const hittable& object);
+
+        // Appends object to the table of its type and returns its index there
+        uint32_t add(const hittable& object, primitive_type type);
+
+        // Closest hit in range below t_max, which is lowered to it
+        bool hit(const primitive_range& range, const ray& r, double t_min, double& t_max, hit_record& rec) const;
+        bool occluded(const primitive_range& range, const ray& r, double t_min, double t_max) const;
+
+    public:
+        sphere_table spheres;
+        moving_sphere_table moving_spheres;
+        triangle_table triangles;
+        rect_table<2, 0, 1> xy_rects;
+        rect_table<1, 0, 2> xz_rects;
+        rect_table<0, 1, 2> yz_rects;
+        std::vector<const hittable*> others;
+};
+
+primitive_type primitive_tables::type_of(const hittable& object) {
+    // Exact types only, a subclass may well hit() differently
+    const auto& type = typeid(object);
+    if (type == typeid(sphere)) return primitive_type::sphere;
+    if (type == typeid(moving_sphere)) return primitive_type::moving_sphere;
+    if (type == typeid(triangle)) return primitive_type::triangle;
+    if (type == typeid(xy_rect)) return primitive_type::xy_rect;
+    if (type == typeid(xz_rect)) return primitive_type::xz_rect;
+    if (type == typeid(yz_rect)) return primitive_type::yz_rect;
+    return primitive_type::other;
+}
+
+uint32_t primitive_tables::add(const hittable& object, primitive_type type) {
+    size_t index = 0;
+    switch (type) {
+        case primitive_type::sphere:
+            index = spheres.mat.size();
+            spheres.add(static_cast<const sphere&>(object));
+            break;
+        case primitive_type::moving_sphere:
+            index = moving_spheres.mat.size();
+            moving_spheres.add(static_cast<const moving_sphere&>(object));
+            break;
+        case primitive_type::triangle:
+            index = triangles.shade.size();
+            triangles.add(static_cast<const triangle&>(object));
+            break;
+        case primitive_type::xy_rect: {
+            const auto& rect = static_cast<const xy_rect&>(object);
+            index = xy_rects.mat.size();
+            xy_rects.add(rect.x0, rect.x1, rect.y0, rect.y1, rect.k, rect.mp.get());
+            break;
+        }
+        case primitive_type::xz_rect: {
+            const auto& rect = static_cast<const xz_rect&>(object);
+            index = xz_rects.mat.size();
+            xz_rects.add(rect.x0, rect.x1, rect.z0, rect.z1, rect.k, rect.mp.get());
+            break;
+        }
+        case primitive_type::yz_rect: {
+            const auto& rect = static_cast<const yz_rect&>(object);
+            index = yz_rects.mat.size();
+            yz_rects.add(rect.y0, rect.y1, rect.z0, rect.z1, rect.k, rect.mp.get());
+            break;
+        }
+        case primitive_type::other:
+            index = others.size();
+            others.push_back(&object);
+            break;
+    }
+    return static_cast<uint32_t>(index);
+}
+
+bool primitive_tables::hit(const primitive_range& range, const ray& r, double t_min, double& t_max, hit_record& rec) const {
+    bool hit_range = false;
+    switch (range.type) {
+        case primitive_type::sphere:
+            hit_range = spheres.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::moving_sphere:
+            hit_range = moving_spheres.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::triangle:
+            hit_range = triangles.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::xy_rect:
+            hit_range = xy_rects.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::xz_rect:
+            hit_range = xz_rects.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::yz_rect:
+            hit_range = yz_rects.hit(range.first, range.count, r, t_min, t_max, &rec);
+            break;
+        case primitive_type::other:
+            for (uint32_t i = range.first; i < range.first + range.count; i++) {
+                if (others[i]->hit(r, t_min, t_max, rec)) {
+                    hit_range = true;
+                    t_max = rec.t;
+                }
+            }
+            return hit_range;
+    }
+    if (hit_range) t_max = rec.t;
+    return hit_range;
+}
+
+bool primitive_tables::occluded(const primitive_range& range, const ray& r, double t_min, double t_max) const {
+    switch (range.type) {
+        case primitive_type::sphere:
+            return spheres.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::moving_sphere:
+            return moving_spheres.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::triangle:
+            return triangles.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::xy_rect:
+            return xy_rects.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::xz_rect:
+            return xz_rects.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::yz_rect:
+            return yz_rects.hit(range.first, range.count, r, t_min, t_max, nullptr);
+        case primitive_type::other:
+            for (uint32_t i = range.first; i < range.first + range.count; i++)
+                if (others[i]->occluded(r, t_min, t_max)) return true;
+            return false;
+    }
+    return false;
+}
+
+// Plain lists and boxes are only containers, their contents go into the tables directly
+inline void gather_primitives(const shared_ptr<hittable>& object, std::vector<shared_ptr<hittable>>& out) {
+    const auto& type = typeid(*object);
+    if (type == typeid(hittable_list)) {
+        for (const auto& child : static_cast<const hittable_list&>(*object).objects)
+            gather_primitives(child, out);
+    } else if (type == typeid(box)) {
+        for (const auto& side : static_cast<const box&>(*object).sides.objects)
+            gather_primitives(side, out);
+    } else {
+        out.push_back(object);
+    }
+}
+
+#endif
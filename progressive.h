@@ -0,0 +1,211 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "rtweekend.h"
+
+#include "adaptive_sampling.h"
+#include "integrator.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Accumulation buffer for progressive rendering. Every pass adds a few samples to each
+// pixel that isn't finished yet, and the buffer keeps the per-pixel sums, the running
+// variance estimates and how many passes every pixel has seen.
+//
+// Pixels draw their random numbers from hash_seed(seed, i, j, passes), so the buffer plus
+// the render seed is the complete RNG state: a resumed render continues with exactly the
+// samples it would have taken without the interruption. That also makes every pixel's
+// state self contained, so a pass can be cut short (on SIGTERM) and checkpointed as is.
+//
+// Checkpoint files are a checkpoint_header followed by the per-pixel arrays, written to
+// a temporary file that is renamed over the old checkpoint, so a crash mid-write leaves
+// the previous one intact.
+
+struct accumulation_buffer {
+    accumulation_buffer(int w, int h)
+        : width(w), height(h), sums(3*static_cast<size_t>(w)*h),
+          estimates(static_cast<size_t>(w)*h), passes(static_cast<size_t>(w)*h) {}
+
+    size_t size() const {return estimates.size();}
+
+    void add(size_t index, const color& sum) {
+        sums[3*index] += sum.x();
+        sums[3*index+1] += sum.y();
+        sums[3*index+2] += sum.z();
+    }
+
+    color mean(size_t index) const {
+        int n = estimates[index].n;
+        if (n == 0) return color(0, 0, 0);
+        return color(sums[3*index], sums[3*index+1], sums[3*index+2]) / n;
+    }
+
+    std::vector<color> means() const {
+        std::vector<color> out(size());
+        for (size_t i = 0; i < size(); i++) out[i] = mean(i);
+        return out;
+    }
+
+    std::vector<int> sample_counts() const {
+        std::vector<int> out(size());
+        for (size_t i = 0; i < size(); i++) out[i] = estimates[i].n;
+        return out;
+    }
+
+    int width, height;
+    std::vector<double> sums;               // rgb per pixel
+    std::vector<pixel_estimate> estimates;  // sample count, luminance mean and variance
+    std::vector<uint32_t> passes;
+};
+
+const uint32_t checkpoint_version = 3;
+
+// The options that decide what a sample estimates. Samples of different estimators can't
+// share a buffer, so a checkpoint only resumes with the same ones. Options the integrator
+// doesn't use are left at 0, changing those is harmless.
+struct estimator_settings {
+    int32_t integrator;
+    int32_t max_depth;
+    int32_t max_depth_iterative;
+    int32_t rr_min_depth;
+    int32_t light_sampling;
+
+    bool operator==(const estimator_settings& other) const {
+        return integrator == other.integrator && max_depth == other.max_depth
+            && max_depth_iterative == other.max_depth_iterative
+            && rr_min_depth == other.rr_min_depth && light_sampling == other.light_sampling;
+    }
+};
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t pad;
+    uint64_t seed;
+    char scene[64];
+    estimator_settings estimator;
+    int32_t pad2;
+    uint64_t view_hash;         // camera, background and skybox, see scene_view_hash
+};
+
+static const char checkpoint_magic[8] = {'R', 'I', 'O', 'W', 'C', 'K', 'P', 'T'};
+
+bool save_checkpoint(const std::string& path, const accumulation_buffer& accum,
+        uint64_t seed, const std::string& scene, const estimator_settings& estimator, uint64_t view_hash) {
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_magic, 8);
+    header.version = checkpoint_version;
+    header.width = accum.width;
+    header.height = accum.height;
+    header.seed = seed;
+    strncpy(header.scene, scene.c_str(), sizeof(header.scene)-1);
+    header.estimator = estimator;
+    header.view_hash = view_hash;
+
+    // The estimates go out field by field, pixel_estimate isn't a file format
+    const size_t n = accum.size();
+    std::vector<int32_t> counts(n);
+    std::vector<double> moments(2*n);
+    for (size_t i = 0; i < n; i++) {
+        counts[i] = accum.estimates[i].n;
+        moments[2*i] = accum.estimates[i].mean;
+        moments[2*i+1] = accum.estimates[i].m2;
+    }
+
+    auto tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "ERROR: Couldn't open checkpoint '" << tmp_path << "' for writing.\n";
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(accum.sums.data(), sizeof(double), accum.sums.size(), file) == accum.sums.size()
+        && fwrite(counts.data(), sizeof(int32_t), n, file) == n
+        && fwrite(moments.data(), sizeof(double), 2*n, file) == 2*n
+        && fwrite(accum.passes.data(), sizeof(uint32_t), n, file) == n;
+    ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Failed writing checkpoint '" << path << "'.\n";
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Refuses checkpoints of another image size, seed, scene, camera, background or estimator,
+// resuming those would just average two different renders.
+bool load_checkpoint(const std::string& path, accumulation_buffer& accum,
+        uint64_t seed, const std::string& scene, const estimator_settings& estimator, uint64_t view_hash) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << "ERROR: Couldn't open checkpoint '" << path << "'.\n";
+        return false;
+    }
+
+    checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, checkpoint_magic, 8) != 0 || header.version != checkpoint_version) {
+        std::cerr << "ERROR: '" << path << "' is not a checkpoint of this version.\n";
+        fclose(file);
+        return false;
+    }
+    header.scene[sizeof(header.scene)-1] = '\0';
+    if (header.width != accum.width || header.height != accum.height
+            || header.seed != seed || scene.compare(0, sizeof(header.scene)-1, header.scene) != 0) {
+        std::cerr << "ERROR: Checkpoint '" << path << "' is of a different render (scene '" << header.scene
+                  << "', " << header.width << "x" << header.height << ", seed " << header.seed << ").\n";
+        fclose(file);
+        return false;
+    }
+    if (header.view_hash != view_hash) {
+        std::cerr << "ERROR: Checkpoint '" << path << "' was rendered with another camera, background"
+                  << " or skybox, pass the same scene overrides as the interrupted render.\n";
+        fclose(file);
+        return false;
+    }
+    if (!(header.estimator == estimator)) {
+        std::cerr << "ERROR: Checkpoint '" << path << "' was rendered with other integrator options"
+                  << " (integrator "
+                  << integrator_name(static_cast<integrator_type>(header.estimator.integrator)) << ", depth " << header.estimator.max_depth
+                  << ", iterative depth " << header.estimator.max_depth_iterative
+                  << ", rr depth " << header.estimator.rr_min_depth
+                  << ", light sampling " << header.estimator.light_sampling << ").\n";
+        fclose(file);
+        return false;
+    }
+
+    const size_t n = accum.size();
+    std::vector<int32_t> counts(n);
+    std::vector<double> moments(2*n);
+    bool ok = fread(accum.sums.data(), sizeof(double), accum.sums.size(), file) == accum.sums.size()
+        && fread(counts.data(), sizeof(int32_t), n, file) == n
+        && fread(moments.data(), sizeof(double), 2*n, file) == 2*n
+        && fread(accum.passes.data(), sizeof(uint32_t), n, file) == n;
+    fclose(file);
+    if (!ok) {
+        std::cerr << "ERROR: Checkpoint '" << path << "' is truncated.\n";
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        accum.estimates[i].n = counts[i];
+        accum.estimates[i].mean = moments[2*i];
+        accum.estimates[i].m2 = moments[2*i+1];
+    }
+    return true;
+}
+
+#endif
@@ -8,11 +8,18 @@ class ray {
         ray() {}
         ray(const point3& origin, const vec3& direction, double time = 0.0)
             : orig(origin), dir(direction), tm(time)
-        {}
+        {
+            // Precomputed for slab tests, every box a ray is tested against reuses them
+            inv_dir = vec3(1.0/dir.x(), 1.0/dir.y(), 1.0/dir.z());
+            sign[0] = inv_dir.x() < 0;
+            sign[1] = inv_dir.y() < 0;
+            sign[2] = inv_dir.z() < 0;
+        }
 
         point3 origin() const  { return orig; }
         vec3 direction() const { return dir; }
         double time() const    {return tm;  }
+        const vec3& inv_direction() const { return inv_dir; }
 
         point3 at(double t) const {
             return orig + t*dir;
@@ -22,6 +29,8 @@ class ray {
         point3 orig;
         vec3 dir;
         double tm;
+        vec3 inv_dir;
+        int sign[3];
 };
 
 #endif
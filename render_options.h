@@ -0,0 +1,392 @@
+#ifndef RENDER_OPTIONS_H
+#define RENDER_OPTIONS_H
+
+#include "rtweekend.h"
+
+#include "integrator.h"
+#include "light_sampler.h"
+#include "progressive.h"
+#include "scenes.h"
+
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Run configuration, from the command line and/or a scene file.
+//
+// Both use the same keys: on the command line as `--key value` (dashes and
+// underscores are interchangeable), in a scene file as `key = value` lines, with
+// '#' starting a comment. The file is read first, so the command line wins.
+// A scene file names one of the builders in scenes.h and can override its camera
+// and background:
+//
+//     scene = cornell_box
+//     lookfrom = 278 278 -800
+//     vfov = 40
+//     background = 0 0 0
+//     spp = 256
+
+struct render_options {
+    int image_width = 1920;
+    int samples_per_pixel = 1600;
+    int max_depth = 16;
+    // The iterative integrator is cut short by russian roulette, so it can afford a far higher cap
+    integrator_type integrator = integrator_type::recursive;
+    int max_depth_iterative = 256;
+    int rr_min_depth = 3;
+    int wave_size = 1 << 16;
+    light_sampling light_mode = light_sampling::uniform;
+
+    // Relative error at which a pixel stops sampling early, 0 = always take spp samples.
+    // With adaptive sampling spp is the per-pixel cap.
+    double adaptive_error = 0;
+    int adaptive_min_spp = 32;
+
+    // Samples added per progressive pass, 0 = everything in one pass, or
+    // checkpoint_pass_spp when checkpointing
+    int pass_spp = 0;
+    std::string checkpoint_path;
+    double checkpoint_interval = 300;   // seconds, checked between passes
+    std::string resume_path;
+
+    int threads = 10;
+    int tile_size = 16;
+    // Every pixel reseeds from this, so the image doesn't depend on thread scheduling
+    uint64_t seed = 1;
+
+    std::string scene = "1";
+    std::string scene_file;
+    // .png, .pfm (HDR) or .ppm, "-" writes a binary PPM to stdout
+    std::string output_path = "-";
+    std::string skybox_path = "../models/christmas_studio_2k.hdr";
+    // Memory for texture tiles shared by all image textures, the rest is paged in on demand
+    int texture_cache_mb = 1024;
+    // Debug image of the samples spent per pixel, white = spp
+    std::string spp_image_path;
+
+    // Camera/background overrides, applied on top of what the scene builder sets up
+    std::vector<std::pair<std::string, std::string>> scene_settings;
+};
+
+// Pass size when checkpointing without --pass-spp. Checkpoints are only written between
+// passes, a single pass would never write one before the render is done.
+const int checkpoint_pass_spp = 16;
+
+void print_usage(const char* program) {
+    std::cerr <<
+        "Usage: " << program << " [options]\n"
+        "  --scene <name|id>          scene to render, see --list-scenes (default 1)\n"
+        "  --scene-file <path>        read options and scene overrides from a file\n"
+        "  --width <px>               image width, height follows the aspect ratio (default 1920)\n"
+        "  --spp <n>                  samples per pixel (default 1600)\n"
+        "  --depth <n>                max bounces of the recursive integrator (default 16)\n"
+        "  --integrator <name>        recursive, iterative, wavefront or nee (default recursive)\n"
+        "  --wave-size <n>            paths in flight per wave of the wavefront integrator (default 65536)\n"
+        "  --max-depth-iterative <n>  max bounces of the iterative and nee integrators (default 256)\n"
+        "  --rr-depth <n>             bounces before russian roulette kicks in (default 3)\n"
+        "  --light-sampling <mode>    uniform, power or spatial (light BVH) (default uniform),\n"
+        "                             power is surface area unless the scene sets light powers\n"
+        "  --adaptive-error <e>       stop sampling a pixel once its relative error is below e,\n"
+        "                             spp becomes the per-pixel cap, unused samples are not\n"
+        "                             given to other pixels (default 0, off)\n"
+        "  --adaptive-min-spp <n>     samples before a pixel may stop early (default 32)\n"
+        "  --spp-image <path>         write the samples spent per pixel, white = spp\n"
+        "  --pass-spp <n>             samples per progressive pass (default 0, all in one pass,\n"
+        "                             16 when checkpointing)\n"
+        "  --checkpoint <path>        save progress there, between passes and on SIGTERM/SIGINT\n"
+        "  --checkpoint-interval <s>  seconds between checkpoints (default 300)\n"
+        "  --resume <path>            continue the render saved in a checkpoint\n"
+        "  --threads <n>              render threads (default 10)\n"
+        "  --tile-size <px>           tile edge length (default 16)\n"
+        "  --seed <n>                 render seed (default 1)\n"
+        "  --output <path>            .png, .ppm or .pfm, - for PPM on stdout (default -)\n"
+        "  --skybox <path>            HDR environment map\n"
+        "  --texture-cache-mb <n>     memory for image texture tiles (default 1024)\n"
+        "  --lookfrom/--lookat/--vup <x y z>, --vfov, --aperture, --aspect-ratio,\n"
+        "  --focus-dist <v>, --background <r g b>\n"
+        "                             (vectors as three arguments or one quoted \"x y z\")\n"
+        "                             override the scene's camera and background\n"
+        "  --list-scenes              list the available scenes\n";
+}
+
+inline bool parse_value(const std::string& text, int& out) {
+    char* end = nullptr;
+    errno = 0;
+    long v = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || v < INT_MIN || v > INT_MAX) return false;
+    out = static_cast<int>(v);
+    return true;
+}
+
+inline bool parse_value(const std::string& text, uint64_t& out) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long v = strtoull(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || text[0] == '-') return false;
+    out = v;
+    return true;
+}
+
+inline bool parse_value(const std::string& text, double& out) {
+    char* end = nullptr;
+    errno = 0;
+    double v = strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0' || errno == ERANGE || !std::isfinite(v)) return false;
+    out = v;
+    return true;
+}
+
+inline bool parse_value(const std::string& text, vec3& out) {
+    std::istringstream in(text);
+    double x, y, z;
+    std::string rest;
+    if (!(in >> x >> y >> z) || (in >> rest)) return false;
+    if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z)) return false;
+    out = vec3(x, y, z);
+    return true;
+}
+
+inline bool is_vec3_setting(const std::string& key) {
+    return key == "lookfrom" || key == "lookat" || key == "vup" || key == "background";
+}
+
+inline bool is_scene_setting(const std::string& key) {
+    return key == "lookfrom" || key == "lookat" || key == "vup" || key == "vfov"
+        || key == "aperture" || key == "aspect_ratio" || key == "focus_dist"
+        || key == "background";
+}
+
+bool set_option(render_options& opts, std::string key, const std::string& value) {
+    for (auto& c : key) if (c == '-') c = '_';
+
+    bool ok = true;
+    if (key == "width") ok = parse_value(value, opts.image_width) && opts.image_width > 0;
+    else if (key == "spp") ok = parse_value(value, opts.samples_per_pixel) && opts.samples_per_pixel > 0;
+    else if (key == "depth") ok = parse_value(value, opts.max_depth) && opts.max_depth > 0;
+    else if (key == "max_depth_iterative") ok = parse_value(value, opts.max_depth_iterative) && opts.max_depth_iterative > 0;
+    else if (key == "rr_depth") ok = parse_value(value, opts.rr_min_depth) && opts.rr_min_depth >= 0;
+    else if (key == "wave_size") ok = parse_value(value, opts.wave_size) && opts.wave_size > 0;
+    else if (key == "adaptive_error") ok = parse_value(value, opts.adaptive_error) && opts.adaptive_error >= 0;
+    else if (key == "adaptive_min_spp") ok = parse_value(value, opts.adaptive_min_spp) && opts.adaptive_min_spp > 1;
+    else if (key == "spp_image") opts.spp_image_path = value;
+    else if (key == "pass_spp") ok = parse_value(value, opts.pass_spp) && opts.pass_spp >= 0;
+    else if (key == "checkpoint") opts.checkpoint_path = value;
+    else if (key == "checkpoint_interval") ok = parse_value(value, opts.checkpoint_interval) && opts.checkpoint_interval >= 0;
+    else if (key == "resume") opts.resume_path = value;
+    else if (key == "threads") ok = parse_value(value, opts.threads) && opts.threads > 0;
+    else if (key == "tile_size") ok = parse_value(value, opts.tile_size) && opts.tile_size > 0;
+    else if (key == "seed") ok = parse_value(value, opts.seed);
+    else if (key == "scene") opts.scene = value;
+    else if (key == "output") opts.output_path = value;
+    else if (key == "skybox") opts.skybox_path = value;
+    else if (key == "texture_cache_mb") ok = parse_value(value, opts.texture_cache_mb) && opts.texture_cache_mb > 0;
+    else if (key == "integrator") ok = parse_integrator(value, opts.integrator);
+    else if (key == "light_sampling") ok = parse_light_sampling(value, opts.light_mode);
+    else if (is_scene_setting(key)) opts.scene_settings.push_back({key, value});
+    else {
+        std::cerr << "ERROR: Unknown option '" << key << "'.\n";
+        return false;
+    }
+
+    if (!ok) std::cerr << "ERROR: Invalid value '" << value << "' for option '" << key << "'.\n";
+    return ok;
+}
+
+bool load_scene_file(const std::string& path, render_options& opts) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "ERROR: Couldn't open scene file '" << path << "'.\n";
+        return false;
+    }
+
+    auto trim = [](const std::string& s) {
+        auto begin = s.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) return std::string();
+        auto end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end-begin+1);
+    };
+
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "ERROR: " << path << ":" << line_number << ": expected 'key = value'.\n";
+            return false;
+        }
+        if (!set_option(opts, trim(line.substr(0, eq)), trim(line.substr(eq+1)))) {
+            std::cerr << "  in " << path << ":" << line_number << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fills opts from argv. Prints usage/scene lists and exits for --help and --list-scenes.
+bool parse_command_line(int argc, char** argv, render_options& opts) {
+    std::vector<std::pair<std::string, std::string>> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (arg == "--list-scenes") {
+            for (const auto& entry : scene_registry())
+                std::cout << entry.id << "  " << entry.name << "\n";
+            exit(0);
+        }
+        if (arg.rfind("--", 0) != 0 || i+1 >= argc) {
+            std::cerr << "ERROR: Expected '--option value', got '" << arg << "'.\n";
+            print_usage(argv[0]);
+            return false;
+        }
+        std::string key = arg.substr(2);
+        std::string value = argv[++i];
+        // Vectors may come as one quoted "x y z" or as three separate arguments
+        for (auto& c : key) if (c == '-') c = '_';
+        if (is_vec3_setting(key) && value.find_first_of(" \t") == std::string::npos) {
+            if (i+2 >= argc || std::string(argv[i+1]).rfind("--", 0) == 0
+                    || std::string(argv[i+2]).rfind("--", 0) == 0) {
+                std::cerr << "ERROR: Expected three values for '--" << arg.substr(2) << "'.\n";
+                return false;
+            }
+            value += std::string(" ") + argv[i+1] + " " + argv[i+2];
+            i += 2;
+        }
+        args.push_back({key, value});
+    }
+
+    // The scene file goes first so that command line options override it
+    for (const auto& arg : args) {
+        if (arg.first == "scene_file") {
+            opts.scene_file = arg.second;
+            if (!load_scene_file(arg.second, opts)) return false;
+        }
+    }
+
+    for (const auto& arg : args) {
+        if (arg.first == "scene_file") continue;
+        if (!set_option(opts, arg.first, arg.second)) return false;
+    }
+    return true;
+}
+
+// Image height for the width and the scene's aspect ratio. The render loop divides by
+// width-1 and height-1, so an image needs at least 2 columns and 2 rows.
+bool image_height_for(int image_width, double aspect_ratio, int& image_height) {
+    const double height = image_width/aspect_ratio;
+    if (image_width < 2 || !(height >= 2) || height > INT_MAX) {
+        std::cerr << "ERROR: A width of " << image_width << " at aspect ratio " << aspect_ratio
+                  << " gives a " << image_width << "x" << height << " image, it needs at least 2x2 pixels.\n";
+        return false;
+    }
+    image_height = static_cast<int>(height);
+    return true;
+}
+
+// The command line that continues an interrupted render: the same options, the checkpoint
+// has to match them, with --resume pointing at the checkpoint instead of any earlier one.
+std::string resume_command(int argc, char** argv, const std::string& checkpoint_path) {
+    auto quoted = [](const std::string& arg) {
+        if (!arg.empty() && arg.find_first_of(" \t\"'\\$`") == std::string::npos) return arg;
+        std::string out = "'";
+        for (char c : arg) out += (c == '\'')? std::string("'\\''") : std::string(1, c);
+        return out + "'";
+    };
+
+    std::string command = quoted(argv[0]);
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if ((arg == "--resume") && i+1 < argc) {
+            i++;
+            continue;
+        }
+        command += " " + quoted(arg);
+    }
+    return command + " --resume " + quoted(checkpoint_path);
+}
+
+// Hash of the camera and background the scene ended up with after the overrides, for the
+// checkpoint header. The skybox path only counts when the scene is lit by the skybox.
+inline uint64_t scene_view_hash(const scene_config& scene, const render_options& opts) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    auto mix = [&](uint64_t bits) {hash = rotl64(hash ^ bits, 29) * 0xbf58476d1ce4e5b9ULL;};
+    auto mix_double = [&](double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        mix(bits);
+    };
+    auto mix_vec = [&](const vec3& v) {for (int a = 0; a < 3; a++) mix_double(v[a]);};
+
+    mix_vec(scene.lookfrom);
+    mix_vec(scene.lookat);
+    mix_vec(scene.vup);
+    mix_double(scene.vfov);
+    mix_double(scene.aperture);
+    mix_double(scene.aspect_ratio);
+    mix_double(scene.focus_dist);
+    mix(scene.use_skybox? 1 : 0);
+    if (scene.use_skybox) {
+        for (unsigned char c : opts.skybox_path) mix(c);
+    } else {
+        mix_vec(scene.background_color);
+    }
+    return splitmix64(hash);
+}
+
+// What the checkpoint header records of the integrator, see estimator_settings
+inline estimator_settings checkpoint_estimator(const render_options& opts) {
+    estimator_settings out{};
+    out.integrator = static_cast<int32_t>(opts.integrator);
+    out.light_sampling = static_cast<int32_t>(opts.light_mode);
+    if (opts.integrator == integrator_type::iterative || opts.integrator == integrator_type::nee) {
+        out.max_depth_iterative = opts.max_depth_iterative;
+        out.rr_min_depth = opts.rr_min_depth;
+    } else {
+        out.max_depth = opts.max_depth;
+    }
+    return out;
+}
+
+bool apply_scene_settings(const render_options& opts, scene_config& scene) {
+    for (const auto& setting : opts.scene_settings) {
+        const auto& key = setting.first;
+        const auto& value = setting.second;
+
+        bool ok;
+        if (key == "lookfrom") ok = parse_value(value, scene.lookfrom);
+        else if (key == "lookat") ok = parse_value(value, scene.lookat);
+        else if (key == "vup") ok = parse_value(value, scene.vup);
+        else if (key == "vfov") ok = parse_value(value, scene.vfov) && scene.vfov > 0 && scene.vfov < 180;
+        else if (key == "aperture") ok = parse_value(value, scene.aperture) && scene.aperture >= 0;
+        else if (key == "aspect_ratio") ok = parse_value(value, scene.aspect_ratio) && scene.aspect_ratio > 0;
+        else if (key == "focus_dist") ok = parse_value(value, scene.focus_dist) && scene.focus_dist > 0;
+        else {
+            ok = parse_value(value, scene.background_color);
+            scene.use_skybox = false;
+        }
+
+        if (!ok) {
+            std::cerr << "ERROR: Invalid value '" << value << "' for scene setting '" << key << "'.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Per-thread random number generation, replaces the global (locked) rand().
+// Each thread owns a xoshiro256++ engine, see https://prng.di.unimi.it/
+// Engines can be reseeded at any time, e.g. per pixel, which makes renders
+// independent of how the work is spread over threads.
+
+inline uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// Mixes a few values (seed, pixel coords, pass, ...) into one well-distributed seed.
+inline uint64_t hash_seed(uint64_t a, uint64_t b = 0, uint64_t c = 0, uint64_t d = 0) {
+    uint64_t state = a;
+    uint64_t h = splitmix64(state);
+    state ^= b; h ^= splitmix64(state);
+    state ^= c; h ^= rotl64(splitmix64(state), 17);
+    state ^= d; h ^= rotl64(splitmix64(state), 31);
+    return h;
+}
+
+class xoshiro256pp {
+    public:
+        xoshiro256pp() {seed(0);}
+        xoshiro256pp(uint64_t seed_value) {seed(seed_value);}
+
+        void seed(uint64_t seed_value) {
+            uint64_t sm = seed_value;
+            for (int i = 0; i < 4; i++) s[i] = splitmix64(sm);
+        }
+
+        uint64_t next() {
+            const uint64_t result = rotl64(s[0] + s[3], 23) + s[0];
+            const uint64_t t = s[1] << 17;
+
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+
+            s[2] ^= t;
+            s[3] = rotl64(s[3], 45);
+
+            return result;
+        }
+
+        // Uniform double in [0, 1), using the top 53 bits.
+        double next_double() {
+            return static_cast<double>(next() >> 11) * 0x1.0p-53;
+        }
+
+    public:
+        uint64_t s[4];
+};
+
+// Four independent xoshiro256+ streams laid out as structure-of-arrays, so the
+// lane loop in fill() maps straight onto SIMD registers.
+class xoshiro256p_x4 {
+    public:
+        static const int lanes = 4;
+
+        void seed(uint64_t seed_value) {
+            uint64_t sm = seed_value;
+            for (int lane = 0; lane < lanes; lane++) {
+                s0[lane] = splitmix64(sm);
+                s1[lane] = splitmix64(sm);
+                s2[lane] = splitmix64(sm);
+                s3[lane] = splitmix64(sm);
+            }
+        }
+
+        void fill(double* out, size_t n) {
+            size_t i = 0;
+            for (; i + lanes <= n; i += lanes) {
+                step(out+i);
+            }
+            if (i < n) {
+                double tail[lanes];
+                step(tail);
+                for (size_t k = 0; i < n; i++, k++) out[i] = tail[k];
+            }
+        }
+
+    private:
+        void step(double* out) {
+            for (int lane = 0; lane < lanes; lane++) {
+                const uint64_t result = s0[lane] + s3[lane];
+                const uint64_t t = s1[lane] << 17;
+
+                s2[lane] ^= s0[lane];
+                s3[lane] ^= s1[lane];
+                s1[lane] ^= s2[lane];
+                s0[lane] ^= s3[lane];
+
+                s2[lane] ^= t;
+                s3[lane] = (s3[lane] << 45) | (s3[lane] >> 19);
+
+                out[lane] = static_cast<double>(result >> 11) * 0x1.0p-53;
+            }
+        }
+
+    private:
+        alignas(32) uint64_t s0[lanes];
+        alignas(32) uint64_t s1[lanes];
+        alignas(32) uint64_t s2[lanes];
+        alignas(32) uint64_t s3[lanes];
+};
+
+struct thread_rng_state {
+    thread_rng_state() {
+        // Threads that never reseed still get distinct streams.
+        static std::atomic<uint64_t> thread_counter{0};
+        reseed(hash_seed(0x5eed, thread_counter.fetch_add(1)));
+    }
+
+    void reseed(uint64_t seed_value) {
+        engine.seed(seed_value);
+        batch_seed = seed_value ^ 0xb47c4f11ULL;
+        batch_seeded = false;
+    }
+
+    xoshiro256pp engine;
+    xoshiro256p_x4 batch_engine;
+    uint64_t batch_seed;
+    bool batch_seeded;
+};
+
+inline thread_rng_state& thread_rng() {
+    thread_local thread_rng_state state;
+    return state;
+}
+
+// Reseeds the calling thread's generators.
+inline void seed_random(uint64_t seed_value) {
+    thread_rng().reseed(seed_value);
+}
+
+// Fills out[0..n) with uniform doubles in [0, 1) from the calling thread's batch generator.
+inline void random_doubles(double* out, size_t n) {
+    auto& state = thread_rng();
+    if (!state.batch_seeded) {
+        state.batch_engine.seed(state.batch_seed);
+        state.batch_seeded = true;
+    }
+    state.batch_engine.fill(out, n);
+}
+
+#endif
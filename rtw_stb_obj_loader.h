@@ -6,23 +6,25 @@
 #include "external/tinyobjloader.h"
 
 #include <stdio.h>
+#include <fstream>
+#include <map>
 
 #include "rtweekend.h"
-#include "bvh.h"
 #include "material.h"
-#include "triangle.h"
+#include "mesh_cache.h"
+#include "triangle_mesh.h"
 
-color _getcol(tinyobj::real_t* raws){
+color _getcol(const double* raws){
     return color(raws[0], raws[1], raws[2]);
 }
-shared_ptr<material> get_mtl_mat(const tinyobj::material_t& reader_mat){
-    shared_ptr<texture> diffuse_a = make_shared<solid_color>(_getcol((tinyobj::real_t*)reader_mat.diffuse));
-    shared_ptr<texture> specular_a = make_shared<solid_color>(_getcol((tinyobj::real_t*)reader_mat.specular));
-    shared_ptr<texture> emissive_a = make_shared<solid_color>(_getcol((tinyobj::real_t*)reader_mat.emission));
-    shared_ptr<texture> transparency_a = make_shared<solid_color>(_getcol((tinyobj::real_t*)reader_mat.transmittance)*(1.-reader_mat.dissolve));
-    shared_ptr<texture> sharpness_a = make_shared<solid_color>(color(1, 0, 0)*reader_mat.shininess);
-
-    return make_shared<mtl_material>(
+shared_ptr<material> get_mtl_mat(const mesh_material_params& reader_mat){
+    shared_ptr<texture> diffuse_a = make_pooled<solid_color>(_getcol(reader_mat.diffuse));
+    shared_ptr<texture> specular_a = make_pooled<solid_color>(_getcol(reader_mat.specular));
+    shared_ptr<texture> emissive_a = make_pooled<solid_color>(_getcol(reader_mat.emission));
+    shared_ptr<texture> transparency_a = make_pooled<solid_color>(_getcol(reader_mat.transmittance)*(1.-reader_mat.dissolve));
+    shared_ptr<texture> sharpness_a = make_pooled<solid_color>(color(1, 0, 0)*reader_mat.shininess);
+
+    return make_pooled<mtl_material>(
             diffuse_a, 
             specular_a, 
             emissive_a, 
@@ -31,92 +33,152 @@ shared_ptr<material> get_mtl_mat(const tinyobj::material_t& reader_mat){
             reader_mat.illum);
 }
 
+mesh_material_params get_mtl_params(const tinyobj::material_t& reader_mat){
+    mesh_material_params params;
+    for (int c = 0; c < 3; c++) {
+        params.diffuse[c] = reader_mat.diffuse[c];
+        params.specular[c] = reader_mat.specular[c];
+        params.emission[c] = reader_mat.emission[c];
+        params.transmittance[c] = reader_mat.transmittance[c];
+    }
+    params.dissolve = reader_mat.dissolve;
+    params.shininess = reader_mat.shininess;
+    params.illum = reader_mat.illum;
+    params.pad = 0;
+    return params;
+}
+
+// The mesh gets the mtl materials, followed by model_material for faces without one
+std::vector<shared_ptr<material>> model_materials(const std::vector<mesh_material_params>& mtls,
+        shared_ptr<material> model_material){
+    std::vector<shared_ptr<material>> materials;
+    for (const auto& params : mtls) materials.push_back(get_mtl_mat(params));
+    materials.push_back(model_material);
+    return materials;
+}
+
+// tinyobj's .mtl reader, noting down every file it looks for so the mesh cache can stamp them
+class recording_material_reader: public tinyobj::MaterialFileReader {
+    public:
+        recording_material_reader(const std::string& _base_dir)
+            : tinyobj::MaterialFileReader(_base_dir), base_dir(_base_dir) {}
+
+        virtual bool operator()(const std::string& mat_id, std::vector<tinyobj::material_t>* materials,
+                std::map<std::string, int>* mat_map, std::string* warn, std::string* err) override {
+            if (base_dir.empty()) paths.push_back(mat_id);
+            else paths.push_back(base_dir + (base_dir.back() == '/'? "" : "/") + mat_id);
+            return tinyobj::MaterialFileReader::operator()(mat_id, materials, mat_map, warn, err);
+        }
+
+    public:
+        std::string base_dir;
+        std::vector<std::string> paths;
+};
+
 shared_ptr<hittable> load_model_from_file(std::string filename, shared_ptr<material> model_material, bool shade_smooth){
+    // Parsing and building the BVH is skipped if there is an up to date cache of both
+    const auto cache_path = mesh_cache_path(filename, shade_smooth);
+    mesh_source_stamp source;
+    const bool have_source = stat_source(filename, source);
+    std::vector<mesh_material_params> mtls;
+
+    if (have_source) {
+        if (auto cached = load_mesh_cache(cache_path, filename, source, shade_smooth, mtls)) {
+            cached->materials = model_materials(mtls, model_material);
+            std::cerr << "Loaded '" << filename << "' from cache: " << cached->face_count()
+                      << " triangles, BVH: " << cached->build_stats << ".\n";
+            return cached;
+        }
+    }
+
     // from https://github.com/mojobojo/OBJLoader/blob/master/example.cc
     std::cerr << "Loading .obj file '" << filename << "'." << std::endl;
 
-    std::string inputfile = filename;
-    // By default searches for mtl file in same dir as obj file, and triangulates
-    tinyobj::ObjReaderConfig reader_config;
-
-    tinyobj::ObjReader reader;
-
-    if (!reader.ParseFromFile(inputfile, reader_config)) {
-      if (!reader.Error().empty()) {
-          std::cerr << "TinyObjReader error: " << reader.Error();
-      }
+    // Searches for mtl files in the same dir as the obj file (like tinyobj::ObjReader), and triangulates
+    const auto slash = filename.find_last_of('/');
+    recording_material_reader mtl_reader(slash == std::string::npos? std::string() : filename.substr(0, slash));
+
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> raw_materials;
+    std::string warn, err;
+    std::ifstream obj_stream(filename);
+    if (!obj_stream || !tinyobj::LoadObj(&attrib, &shapes, &raw_materials, &warn, &err, &obj_stream, &mtl_reader)) {
+      std::cerr << "TinyObjReader error: " << (err.empty()? "couldn't open '" + filename + "'\n" : err);
       exit(1);
     }
 
-    if (!reader.Warning().empty()) {
-      std::cerr << "TinyObjReader warning: " << reader.Warning();
+    if (!warn.empty()) {
+      std::cerr << "TinyObjReader warning: " << warn;
     }
 
-    auto& attrib = reader.GetAttrib();
-    auto& shapes = reader.GetShapes();
-    auto& raw_materials = reader.GetMaterials();
-
-    std::vector<shared_ptr<material>> converted_mats;
     for(auto& raw_mat: raw_materials){
-        converted_mats.push_back(get_mtl_mat(raw_mat));
+        mtls.push_back(get_mtl_params(raw_mat));
     }
 
     const bool use_mtl_file = (raw_materials.size() != 0);
+    if (mtls.size() >= 0xffff) {
+        std::cerr << "ERROR: Too many materials in '" << filename << "'.\n";
+        exit(1);
+    }
+    const auto fallback_material = static_cast<uint16_t>(mtls.size());
+
+    mesh_buffers mesh;
+    mesh.positions.assign(attrib.vertices.begin(), attrib.vertices.end());
+    mesh.uvs.assign(attrib.texcoords.begin(), attrib.texcoords.end());
+    if (shade_smooth) {
+        mesh.normals.resize(attrib.normals.size());
+        for (size_t i = 0; i+2 < attrib.normals.size(); i += 3) {
+            auto n = unit_vector(vec3(attrib.normals[i], attrib.normals[i+1], attrib.normals[i+2]));
+            for (int a = 0; a < 3; a++) mesh.normals[i+a] = static_cast<float>(n[a]);
+        }
+    }
 
-    hittable_list model_output;
-
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++) {
-         
-        hittable_list shape_triangles;
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            const int fv = 3; assert(shapes[s].mesh.num_face_vertices[f]==fv);
-
-            vec3 tri_v[3];
-            vec3 tri_vn[3];
+    size_t n_faces = 0;
+    for (const auto& shape : shapes) n_faces += shape.mesh.num_face_vertices.size();
+    mesh.vertex_indices.reserve(3*n_faces);
+    if (shade_smooth) mesh.normal_indices.reserve(3*n_faces);
+    if (!attrib.texcoords.empty()) mesh.uv_indices.reserve(3*n_faces);
+    mesh.material_ids.reserve(n_faces);
 
+    // All shapes go into one mesh with a single BVH, a BVH per shape only adds overlapping roots
+    for (const auto& shape : shapes) {
+        for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
+            assert(shape.mesh.num_face_vertices[f] == 3);
 
-            // Loop over vertices in the face.
+            // A face is only smooth shaded if all its corners have normals
+            bool has_normals = true, has_uvs = true;
             for (size_t v = 0; v < 3; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                tinyobj::real_t vx = attrib.vertices[3*size_t(idx.vertex_index)+0];
-                tinyobj::real_t vy = attrib.vertices[3*size_t(idx.vertex_index)+1];
-                tinyobj::real_t vz = attrib.vertices[3*size_t(idx.vertex_index)+2];
-                
-                tri_v[v] = vec3(vx, vy, vz);
-     
-                // Check if `normal_index` is zero or positive. negative = no normal data
-                if (idx.normal_index >= 0) {
-                    tinyobj::real_t nx = attrib.normals[3*size_t(idx.normal_index)+0];
-                    tinyobj::real_t ny = attrib.normals[3*size_t(idx.normal_index)+1];
-                    tinyobj::real_t nz = attrib.normals[3*size_t(idx.normal_index)+2];
-
-                    tri_vn[v] = vec3(nx, ny, nz);
-                } else {
-                    assert(0);
-                }
+                const auto& idx = shape.mesh.indices[3*f + v];
+                has_normals = has_normals && idx.normal_index >= 0;
+                has_uvs = has_uvs && idx.texcoord_index >= 0;
             }
-            shared_ptr<material> tri_mat;
-            if (use_mtl_file){
-                tri_mat = converted_mats[shapes[s].mesh.material_ids[f]];
-            } else {
-                tri_mat = model_material;
+
+            for (size_t v = 0; v < 3; v++) {
+                const auto& idx = shape.mesh.indices[3*f + v];
+                mesh.vertex_indices.push_back(static_cast<uint32_t>(idx.vertex_index));
+                if (shade_smooth)
+                    mesh.normal_indices.push_back(has_normals? static_cast<uint32_t>(idx.normal_index) : triangle_mesh::no_index);
+                if (!attrib.texcoords.empty())
+                    mesh.uv_indices.push_back(has_uvs? static_cast<uint32_t>(idx.texcoord_index) : triangle_mesh::no_index);
             }
-            shape_triangles.add(make_shared<triangle>(
-                tri_v[0], tri_v[1], tri_v[2], 
-                tri_vn[0], tri_vn[1], tri_vn[2], 
-                shade_smooth, tri_mat));
 
-            index_offset += fv;
+            int mat_id = use_mtl_file? shape.mesh.material_ids[f] : -1;
+            mesh.material_ids.push_back(mat_id >= 0? static_cast<uint16_t>(mat_id) : fallback_material);
         }
-
-        model_output.add(make_shared<bvh_node>(shape_triangles, 0, 1));
     }
 
-    return make_shared<bvh_node>(model_output, 0, 1);
+    auto model = make_pooled<triangle_mesh>(std::move(mesh), model_materials(mtls, model_material));
+    std::cerr << "Model: " << model->face_count() << " triangles, "
+              << model->memory_usage()/(1024*1024) << " MiB, BVH: " << model->build_stats << ".\n";
+
+    std::vector<mesh_mtl_file> mtl_files(mtl_reader.paths.size());
+    bool stamped = true;
+    for (size_t i = 0; i < mtl_files.size(); i++)
+        stamped = stamp_mtl_file(mtl_reader.paths[i], mtl_files[i]) && stamped;
+    if (have_source && (!stamped || !save_mesh_cache(cache_path, filename, source, shade_smooth, *model, mtls, mtl_files)))
+        std::cerr << "Couldn't write mesh cache '" << cache_path << "'.\n";
+    return model;
 }
 
 #endif
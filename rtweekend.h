@@ -7,6 +7,8 @@
 #include <memory>
 #include <random>
 
+#include "rng.h"
+
 // Usings
 
 using std::shared_ptr;
@@ -18,6 +20,20 @@ using std::sqrt;
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+// Storage precision of vec3, pick float with -DRTW_VEC3_FLOAT (see vec3.h).
+// Epsilons that depend on how finely positions can be represented follow it:
+// ray_epsilon is the t_min for rays leaving a surface, box_padding the half
+// thickness given to flat bounding boxes.
+#ifdef RTW_VEC3_FLOAT
+using vec3_real = float;
+const double ray_epsilon = 1e-4;
+const double box_padding = 1e-3;
+#else
+using vec3_real = double;
+const double ray_epsilon = 0.000001;
+const double box_padding = 0.000001;
+#endif
+
 // Utility Functions
 
 inline double degrees_to_radians(double degrees) {
@@ -25,7 +41,8 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    return rand()/(RAND_MAX+1.0);
+    // Returns a random real in [0,1), from the calling thread's own engine.
+    return thread_rng().engine.next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,541 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "rtweekend.h"
+#include "arena.h"
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "triangle.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "texture.h"
+#include "rtw_stb_obj_loader.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+hittable_list rt_iow_final_scene() {
+    hittable_list world;
+
+    auto checker = make_pooled<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    world.add(make_pooled<sphere>(point3(0,-1000,0), 1000, make_pooled<lambertian>(checker)));
+
+    const int extent = 11; // default 11
+    for (int a = -extent; a < extent; a++) {
+        for (int b = -extent; b < extent; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = make_pooled<lambertian>(albedo);
+                    auto center2 = center+vec3(0, random_double(0, 0.5), 0);
+                    world.add(make_pooled<moving_sphere>(center, center2, 0.0, 1.0, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = make_pooled<metal>(albedo, fuzz);
+                    world.add(make_pooled<sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = make_pooled<dielectric>(1.5);
+                    world.add(make_pooled<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = make_pooled<dielectric>(1.5);
+    world.add(make_pooled<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = make_pooled<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(make_pooled<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_pooled<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_pooled<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+hittable_list rt_iow_final_scene_lights(){
+    // an empty hittable list gives importance sampling with cosine distribution over the normal-hemisphere
+    hittable_list lights;
+    return lights;
+}
+
+/*
+hittable_list two_spheres() {
+    hittable_list objects;
+
+    auto checker = make_pooled<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+
+    objects.add(make_pooled<sphere>(point3(0,-10, 0), 10, make_pooled<lambertian>(checker)));
+    objects.add(make_pooled<sphere>(point3(0, 10, 0), 10, make_pooled<lambertian>(checker)));
+
+    return objects;
+}
+
+hittable_list two_perlin_spheres() {
+    hittable_list objects;
+
+    auto pertext = make_pooled<noise_texture>(4);
+
+    objects.add(make_pooled<sphere>(point3(0,-1000, 0), 1000, make_pooled<lambertian>(pertext)));
+    objects.add(make_pooled<sphere>(point3(0, 2, 0), 2, make_pooled<lambertian>(pertext)));
+
+    return objects;
+}
+
+hittable_list earth() {
+    auto earth_texture = make_pooled<image_texture>("../src/textures/earthmap.jpg");
+    auto earth_surface = make_pooled<lambertian>(earth_texture);
+    auto globe = make_pooled<sphere>(point3(0, 0, 0), 2, earth_surface);
+
+    return hittable_list(globe);
+}
+
+hittable_list simple_light() {
+    hittable_list objects;
+
+    auto pertext = make_pooled<noise_texture>(4);
+    objects.add(make_pooled<sphere>(point3(0,-1000,0), 1000, make_pooled<lambertian>(pertext)));
+    objects.add(make_pooled<sphere>(point3(0,2,0), 2, make_pooled<lambertian>(pertext)));
+
+    auto difflight = make_pooled<diffuse_light>(color(4,4,4));
+    objects.add(make_pooled<xy_rect>(3, 5, 1, 3, -2, difflight));
+
+    return objects;
+}
+
+hittable_list cornell_smoke() {
+    hittable_list objects;
+
+    auto red   = make_pooled<lambertian>(color(.65, .05, .05));
+    auto white = make_pooled<lambertian>(color(.73, .73, .73));
+    auto green = make_pooled<lambertian>(color(.12, .45, .15));
+    auto light = make_pooled<diffuse_light>(color(7, 7, 7));
+
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_pooled<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_pooled<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<hittable> box1 = make_pooled<box>(point3(0,0,0), point3(165,330,165), white);
+    box1 = make_pooled<rotate_y>(box1, 15);
+    box1 = make_pooled<translate>(box1, vec3(265,0,295));
+
+    shared_ptr<hittable> box2 = make_pooled<box>(point3(0,0,0), point3(165,165,165), white);
+    box2 = make_pooled<rotate_y>(box2, -18);
+    box2 = make_pooled<translate>(box2, vec3(130,0,65));
+
+    objects.add(make_pooled<constant_medium>(box1, 0.01, color(0,0,0)));
+    objects.add(make_pooled<constant_medium>(box2, 0.01, color(1,1,1)));
+
+    return objects;
+}
+*/
+
+hittable_list rt_tnw_final_scene() {
+    hittable_list boxes1;
+    auto ground = make_pooled<lambertian>(color(0.48, 0.83, 0.53));
+
+    const int boxes_per_side = 20;
+    for (int i = 0; i < boxes_per_side; i++) {
+        for (int j = 0; j < boxes_per_side; j++) {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i*w;
+            auto z0 = -1000.0 + j*w;
+            auto y0 = 0.0;
+            auto x1 = x0 + w;
+            auto y1 = random_double(1,101);
+            auto z1 = z0 + w;
+
+            boxes1.add(make_pooled<box>(point3(x0,y0,z0), point3(x1,y1,z1), ground));
+        }
+    }
+
+    hittable_list objects;
+
+    objects.add(make_pooled<bvh4>(boxes1, 0, 1));
+
+    auto light = make_pooled<diffuse_light>(color(7, 7, 7));
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(123, 423, 147, 412, 554, light)));
+
+    auto center1 = point3(400, 400, 200);
+    auto center2 = center1 + vec3(30,0,0);
+    auto moving_sphere_material = make_pooled<lambertian>(color(0.7, 0.3, 0.1));
+    objects.add(make_pooled<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+    objects.add(make_pooled<sphere>(point3(260, 150, 45), 50, make_pooled<dielectric>(1.5)));
+    objects.add(make_pooled<sphere>(
+        point3(0, 150, 145), 50, make_pooled<metal>(color(0.8, 0.8, 0.9), 1.0)
+    ));
+
+    auto boundary = make_pooled<sphere>(point3(360,150,145), 70, make_pooled<dielectric>(1.5));
+    objects.add(boundary);
+    objects.add(make_pooled<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    boundary = make_pooled<sphere>(point3(0, 0, 0), 5000, make_pooled<dielectric>(1.5));
+    objects.add(make_pooled<constant_medium>(boundary, .0001, color(1,1,1)));
+
+    auto emat = make_pooled<lambertian>(make_pooled<image_texture>("textures/earthmap.jpg"));
+    objects.add(make_pooled<sphere>(point3(400,200,400), 100, emat));
+    auto pertext = make_pooled<marble_texture>(0.1);
+    objects.add(make_pooled<sphere>(point3(220,280,300), 80, make_pooled<lambertian>(pertext)));
+
+    hittable_list boxes2;
+    auto white = make_pooled<lambertian>(color(.73, .73, .73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++) {
+        boxes2.add(make_pooled<sphere>(point3::random(0,165), 10, white));
+    }
+
+    objects.add(make_pooled<translate>(
+        make_pooled<rotate_y>(
+            make_pooled<bvh4>(boxes2, 0.0, 1.0), 15),
+            vec3(-100,270,395)
+        )
+    );
+
+    return objects;
+}
+
+hittable_list rt_tnw_final_scene_lights() {
+    hittable_list lights;
+    auto mat = make_pooled<material>();
+
+    lights.add(make_pooled<xz_rect>(123, 423, 147, 412, 554, mat));
+
+    return lights;
+}
+
+hittable_list cornell_box() {
+    hittable_list objects;
+
+    auto red   = make_pooled<lambertian>(color(.65, .05, .05));
+    auto white = make_pooled<lambertian>(color(.73, .73, .73));
+    auto green = make_pooled<lambertian>(color(.12, .45, .15));
+    auto light = make_pooled<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(213, 343, 227, 332, 554, light)));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_pooled<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<material> aluminum = make_pooled<metal>(color(0.8, 0.85, 0.88), 0.0);
+    shared_ptr<hittable> box1 = make_pooled<box>(point3(0,0,0), point3(165,330,165), aluminum);
+    box1 = make_pooled<rotate_y>(box1, 15);
+    box1 = make_pooled<translate>(box1, vec3(265,0,295));
+    objects.add(box1);
+
+    auto glass = make_pooled<dielectric>(1.5);
+    objects.add(make_pooled<sphere>(point3(190,90,190), 90 , glass));
+
+    return objects;
+}
+
+hittable_list cornell_box_lights(){
+    hittable_list lights;
+    lights.add(make_pooled<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    lights.add(make_pooled<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));    
+    lights.add(make_pooled<box>(point3(0,0,0), point3(165,330,165), shared_ptr<material>()));
+    return lights;
+}
+
+hittable_list triangle_test() {
+    hittable_list objects;
+
+    auto light = make_pooled<diffuse_light>(color(1, 1, 1));
+    auto grey = make_pooled<lambertian>(color(0.5, 0.5, 0.5));
+    auto blue = make_pooled<lambertian>(color(0.1, 0.1, 0.7));
+
+    objects.add(make_pooled<xy_rect>(-10, 10, -10, 10, 0, grey));
+    triangle light_tri = triangle(vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), light);
+    objects.add(make_pooled<triangle>(light_tri));
+
+    objects.add(make_pooled<triangle>(triangle(vec3(1, 0, 0), vec3(1, 0, 2), vec3(1, 2, 2), blue)));
+
+    return objects;
+}
+
+hittable_list triangle_test_lights() {
+    hittable_list lights;
+
+    triangle test_tri = triangle(vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), shared_ptr<material>());
+    lights.add(make_pooled<triangle>(test_tri));
+
+    return lights;
+}
+
+hittable_list obj_loader_test(){
+    hittable_list objects;
+
+    auto grey = make_pooled<lambertian>(color(0.5, 0.5, 0.5));
+    auto light = make_pooled<diffuse_light>(color(1, 1, 1)*10);
+    objects.add(make_pooled<xz_rect>(-10, 10, -10, 10, -1, grey));
+    //objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(-1, 1, 2, 3, 4, light)));
+    
+    objects.add(load_model_from_file("../models/suzanne.obj", grey, false));
+
+    return objects;
+}
+
+hittable_list obj_loader_test_lights(){
+    hittable_list lights;
+
+    //lights.add(make_pooled<flip_face>(make_pooled<xz_rect>(-1, 1, 2, 3, 4, shared_ptr<material>())));
+
+    return lights;
+}
+
+hittable_list boeing_test_world(){
+    hittable_list objects;
+
+    auto grey = make_pooled<lambertian>(color(0.5, 0.5, 0.5));
+    auto light = make_pooled<diffuse_light>(color(1, 1, 1)*100);
+    int ground_size = 80;
+    objects.add(make_pooled<xy_rect>(-ground_size/2., ground_size/2., -ground_size/2., ground_size/2., -8, grey));
+    objects.add(make_pooled<flip_face>(make_pooled<xy_rect>(-5, 5, -5, 5, 40, light)));
+    
+    objects.add(load_model_from_file("../models/boeing_737_900.obj", grey, true));
+
+    return objects;
+}
+
+hittable_list boeing_test_world_lights(){
+    hittable_list lights;
+
+    lights.add(make_pooled<flip_face>(make_pooled<xy_rect>(-5, 5, -5, 5, 40, shared_ptr<material>())));
+
+    return lights;
+}
+
+hittable_list cornell_klein_box() {
+    hittable_list objects;
+
+    auto red   = make_pooled<lambertian>(color(.65, .05, .05));
+    auto white = make_pooled<lambertian>(color(.73, .73, .73));
+    auto green = make_pooled<lambertian>(color(.12, .45, .15));
+    auto light = make_pooled<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_pooled<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(213, 343, 227, 332, 554, light)));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_pooled<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_pooled<xy_rect>(0, 555, 0, 555, 555, white));
+
+    /*
+    shared_ptr<material> aluminum = make_pooled<metal>(color(0.8, 0.85, 0.88), 0.0);
+    shared_ptr<hittable> box1 = make_pooled<box>(point3(0,0,0), point3(165,330,165), aluminum);
+    box1 = make_pooled<rotate_y>(box1, 15);
+    box1 = make_pooled<translate>(box1, vec3(265,0,295));
+    objects.add(box1);
+
+    auto glass = make_pooled<dielectric>(1.5);
+    objects.add(make_pooled<sphere>(point3(190,90,190), 90 , glass));*/
+    auto glass = make_pooled<dielectric>(1.5);
+    vec3 move_klein(300, 60, 200);
+    objects.add(make_pooled<translate>(load_model_from_file("../models/klein_bottle.obj", glass, true), move_klein));
+
+    return objects;
+}
+
+hittable_list cornell_klein_box_lights(){
+    hittable_list lights;
+    lights.add(make_pooled<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    return lights;
+}
+
+hittable_list theodor_test1_world(){
+    hittable_list objects;
+
+    auto grey = make_pooled<lambertian>(color(0.5, 0.5, 0.5));
+    auto metal_mat = make_pooled<metal>(color(0.6, 0.6, 0.6), 0.3);
+    auto light = make_pooled<diffuse_light>(color(1, 1, 1)*300);
+    int ground_size = 140;
+    objects.add(make_pooled<xz_rect>(-ground_size/2., ground_size/2., -ground_size/2., ground_size/2., -8, grey));
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5, 5, -5, 5, 150, light)));
+    double camoffset0 = 60;
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5+camoffset0, 5+camoffset0, -5, 5, 150, light)));
+    objects.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5, 5, -5+camoffset0, 5+camoffset0, 150, light)));
+    
+    vec3 displacement(-25, 0, 10);
+    shared_ptr<hittable> model = (make_pooled<translate>(load_model_from_file("../models/from_theodor.obj", metal_mat, true), displacement));
+    objects.add(model);
+
+    return objects;
+}
+
+hittable_list theodor_test1_lights(){
+    hittable_list lights;
+
+    lights.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5, 5, -5, 5, 150, shared_ptr<material>())));
+    double camoffset0 = 60;
+    lights.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5+camoffset0, 5+camoffset0, -5, 5, 150, shared_ptr<material>())));
+    lights.add(make_pooled<flip_face>(make_pooled<xz_rect>(-5, 5, -5+camoffset0, 5+camoffset0, 150, shared_ptr<material>())));
+
+    return lights;
+}
+
+hittable_list single_sphere() {
+    hittable_list objects;
+
+    auto grey = make_pooled<lambertian>(color(0.5, 0.5, 0.5));
+    objects.add(make_pooled<sphere>(vec3(), 1, grey));
+
+    return objects;
+}
+
+// Everything a scene decides about a render, filled in by its entry in scene_registry().
+struct scene_config {
+    hittable_list world;
+    shared_ptr<hittable> lights = make_shared<hittable_list>();
+    // Power of every light for --light-sampling power/spatial, empty = their surface areas
+    std::vector<double> light_powers;
+
+    point3 lookfrom, lookat;
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 40.0;
+    double aperture = 0.0;
+    double aspect_ratio = 16./9.;
+    double focus_dist = 10;
+
+    // Lit by the HDR skybox unless a scene asks for a plain background
+    bool use_skybox = true;
+    color background_color = color(0, 0, 0);
+
+    // Owns the scene's objects, see arena.h
+    shared_ptr<scene_arena> arena;
+};
+
+struct scene_entry {
+    int id;
+    const char* name;
+    void (*setup)(scene_config& scene);
+};
+
+// Ids match the old scene_to_render numbering, names the builder functions.
+const std::vector<scene_entry>& scene_registry() {
+    static const std::vector<scene_entry> registry = {
+        {1, "rt_iow_final_scene", [](scene_config& scene) {
+            scene.world = rt_iow_final_scene();
+            scene.lights = make_pooled<hittable_list>(rt_iow_final_scene_lights());
+            scene.lookfrom = point3(13,2,3);
+            scene.lookat = point3(0,0,0);
+            scene.vfov = 20.0;
+            scene.aperture = 0.1;
+        }},
+        {6, "cornell_box", [](scene_config& scene) {
+            scene.world = cornell_box();
+            scene.lights = make_pooled<hittable_list>(cornell_box_lights());
+            scene.use_skybox = false;
+            scene.background_color = color(0, 0, 0);
+            scene.aspect_ratio = 1.0;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 40.0;
+        }},
+        {8, "rt_tnw_final_scene", [](scene_config& scene) {
+            scene.world = rt_tnw_final_scene();
+            scene.lights = make_pooled<hittable_list>(rt_tnw_final_scene_lights());
+            scene.lookfrom = point3(478, 278, -600);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 45.0;
+        }},
+        {9, "triangle_test", [](scene_config& scene) {
+            scene.world = triangle_test();
+            scene.lights = make_pooled<hittable_list>(triangle_test_lights());
+            scene.lookfrom = point3(-4, 1, 2);
+            scene.lookat = point3(0, 0, 1);
+            scene.vup = vec3(0, 0, 1);
+            scene.vfov = 40.0;
+        }},
+        {10, "obj_loader_test", [](scene_config& scene) {
+            scene.world = obj_loader_test();
+            scene.lights = make_pooled<hittable_list>(obj_loader_test_lights());
+            scene.lookfrom = point3(0, 0.5, -3);
+            scene.lookat = point3(0, -0.1, 0);
+            scene.vfov = 45.0;
+        }},
+        {11, "boeing_test_world", [](scene_config& scene) {
+            scene.vup = vec3(0, 0, 1);
+            scene.world = boeing_test_world();
+            scene.lights = make_pooled<hittable_list>(boeing_test_world_lights());
+            scene.lookfrom = point3(0, -40, 20);
+            scene.lookat = point3(0, 0, 0);
+            scene.vfov = 40.0;
+        }},
+        {12, "cornell_klein_box", [](scene_config& scene) {
+            scene.world = cornell_klein_box();
+            scene.lights = make_pooled<hittable_list>(cornell_klein_box_lights());
+            scene.aspect_ratio = 1.0;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 40.0;
+        }},
+        {13, "theodor_test1_world", [](scene_config& scene) {
+            scene.world = theodor_test1_world();
+            scene.lights = make_pooled<hittable_list>(theodor_test1_lights());
+            scene.lookfrom = point3(40, 55, 40);
+            scene.lookat = point3(-10, 5, 0);
+            scene.vfov = 45.0;
+        }},
+        {14, "single_sphere", [](scene_config& scene) {
+            scene.world = single_sphere();
+            scene.lookfrom = point3(40, 55, 40);
+            scene.lookat = point3(-10, 5, 0);
+            scene.vfov = 45.0;
+        }},
+    };
+    return registry;
+}
+
+// Looks a scene up by registry name or numeric id.
+const scene_entry* find_scene(const std::string& name_or_id) {
+    char* end = nullptr;
+    long id = strtol(name_or_id.c_str(), &end, 10);
+    bool numeric = !name_or_id.empty() && *end == '\0';
+
+    for (const auto& entry : scene_registry()) {
+        if (numeric? entry.id == id : name_or_id == entry.name) return &entry;
+    }
+    return nullptr;
+}
+
+bool load_scene(const std::string& name_or_id, scene_config& scene) {
+    auto entry = find_scene(name_or_id);
+    if (!entry) {
+        std::cerr << "ERROR: Unknown scene '" << name_or_id << "', available scenes:\n";
+        for (const auto& e : scene_registry())
+            std::cerr << "  " << e.id << "  " << e.name << "\n";
+        return false;
+    }
+
+    scene.arena = make_shared<scene_arena>();
+    {
+        scene_arena::scope in_arena(scene.arena);
+        entry->setup(scene);
+    }
+    std::cerr << "Scene arena: " << scene.arena->object_count() << " objects, "
+              << scene.arena->bytes_used()/1024 << " KiB in " << scene.arena->pool_count() << " pools\n";
+    return true;
+}
+
+#endif
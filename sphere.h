@@ -13,10 +13,15 @@ class sphere: public hittable {
         sphere(point3 cen, double r, shared_ptr<material> m): center(cen), radius(r), mat_ptr(m) {};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double root;
+            return nearest_root(r, t_min, t_max, root);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
         virtual double pdf_value(const point3& o, const vec3& v ) const override;
         virtual vec3 random(const point3& o) const override;
+        virtual double surface_area() const override {return 4*pi*radius*radius;}
 
     // Still public
     public:
@@ -24,7 +29,7 @@ class sphere: public hittable {
         double radius;
         shared_ptr<material> mat_ptr;
 
-    private:
+        // Also used by sphere_table (primitive_table.h)
         static void get_sphere_uv(const point3 &p, double& u, double&v){
             // p: a given point on the sphere of radius one, centered at the origin.
             // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -40,9 +45,11 @@ class sphere: public hittable {
             v = theta / pi;
         }
 
+    private:
+        bool nearest_root(const ray& r, double t_min, double t_max, double& root) const;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool sphere::nearest_root(const ray& r, double t_min, double t_max, double& root) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -53,19 +60,25 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double root;
+    if (!nearest_root(r, t_min, t_max, root)) return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     return true;
 }
@@ -79,8 +92,7 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double sphere::pdf_value(const point3& o, const vec3& v) const {
-    hit_record rec;
-    if (!this->hit(ray(o, v), 0.000001, infinity, rec))
+    if (!occluded(ray(o, v), ray_epsilon, infinity))
         return 0;
 
     auto cos_theta_max = sqrt(1 - radius*radius/((center-o).length_squared()));
@@ -2,8 +2,10 @@
 #define TEXTURE_H
 
 #include "rtweekend.h"
+#include "arena.h"
 #include "rtw_stb_image.h"
 #include "perlin.h"
+#include "texture_cache.h"
 
 #include <iostream>
 
@@ -33,7 +35,7 @@ class checker_texture: public texture {
 
         checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd): even(_even), odd(_odd) {}
 
-        checker_texture(color c1, color c2): even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
+        checker_texture(color c1, color c2): even(make_pooled<solid_color>(c1)), odd(make_pooled<solid_color>(c2)) {}
 
         virtual color value(double u, double v, const point3& p) const override {
             auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
@@ -74,13 +76,17 @@ class marble_texture: public texture {
         double scale;
 };
 
+// Image textures live in the shared texture cache as tiled mip pyramids (texture_cache.h),
+// the decoded image is only kept around while the pyramid is built.
+// value() has no ray footprint to pick a mip level from, so it always reads level 0;
+// the coarser levels are only reached through value_lod() with an explicit level.
+enum class texture_filter {nearest, bilinear};
+
 class image_texture: public texture {
     public:
-        const static int bytes_per_pixel = 3;
-
-        image_texture(): data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+        image_texture(): width(0), height(0) {}
 
-        image_texture(const char* filename){
+        image_texture(const char* filename, texture_filter _filter = texture_filter::bilinear): filter(_filter) {
             auto components_per_pixel = 3;
             std::cerr << "Loading image texture from: '" << filename << "' as ";
             if (stbi_is_hdr(filename)){
@@ -88,48 +94,66 @@ class image_texture: public texture {
             } else {
                 std::cerr << "gamma-corrected file.\n";
             }
-            data = stbi_loadf(filename, &width, &height, &components_per_pixel, components_per_pixel);
+            float* data = stbi_loadf(filename, &width, &height, &components_per_pixel, components_per_pixel);
 
             if (!data){
                 std::cerr << "ERROR: Couldn't load texture image file: '" << filename << "'.\n";
                 exit(1);
             }
 
-            bytes_per_scanline = bytes_per_pixel*width;
-        }
-        
-        ~image_texture(){
-            delete data;
+            image = make_shared<mip_tiled_image>(data, width, height);
+            stbi_image_free(data);
         }
 
         virtual color value(double u, double v, const vec3& p) const override {
+            return lookup(u, v);
+        }
+
+        // Trilinear lookup, lod is the mip level, 0 is full resolution and every level halves it
+        color value_lod(double u, double v, double lod) const {
             // if no texture data, return cyan as debugging color
-            if (data == nullptr){
-                return color(0, 1, 1);
-            }
+            if (!image) return color(0, 1, 1);
 
-            // Clamp texture coordinates to valid range
             u = clamp(u, 0.0, 1.0);
             v = 1-clamp(v, 0.0, 1.0); // Flipping to image coords
+            return image->trilinear(u, v, lod);
+        }
 
-            auto i = static_cast<int>(u*width);
-            auto j = static_cast<int>(v*height);
+        // Mip level for a lookup covering footprint (in uv units) of the texture
+        double lod_for_footprint(double footprint) const {
+            double texels = footprint*std::max(width, height);
+            return texels > 1? log2(texels) : 0;
+        }
 
-            // Clamp the integer mapping, coords must be less than 1.0
-            if (i >= width)  i = width-1;
-            if (j >= height) j = height-1;
+        // Full resolution texel, x, y from the top left
+        color texel(int x, int y) const {
+            if (!image) return color(0, 1, 1);
+            return image->texel(0, x, y);
+        }
 
-            const auto color_scale = 1.0;// /255.0;
+    private:
+        color lookup(double u, double v) const {
+            if (!image) return color(0, 1, 1);
+
+            // Clamp texture coordinates to valid range
+            u = clamp(u, 0.0, 1.0);
+            v = 1-clamp(v, 0.0, 1.0); // Flipping to image coords
 
-            auto pixel = data+j*bytes_per_scanline+i*bytes_per_pixel;
+            if (filter == texture_filter::bilinear)
+                return image->bilinear(0, u*width, v*height);
 
-            return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+            // Clamp the integer mapping, coords must be less than 1.0
+            auto i = std::min(static_cast<int>(u*width), width-1);
+            auto j = std::min(static_cast<int>(v*height), height-1);
+            return image->texel(0, i, j);
         }
 
     public:
-        float *data;
         int width, height;
-        int bytes_per_scanline;
+        texture_filter filter = texture_filter::bilinear;
+
+    private:
+        shared_ptr<mip_tiled_image> image;
 };
 
 class roughness_from_sharpness_texture: public texture {
@@ -0,0 +1,278 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+// Tiled, mipmapped textures behind a shared cache of bounded size.
+//
+// A mip_tiled_image is decoded once, filtered down into a mip pyramid and cut into
+// 32x32 texel tiles that go into an (unlinked) temporary file. After that only the tiles
+// that are actually looked up live in memory, in texture_tile_cache, which evicts the
+// least recently used tiles once the budget is reached and pages them back in from the
+// file on demand. Every render thread also keeps a small direct-mapped table of the
+// tiles it used last, so most lookups never touch the shared cache or its locks.
+//
+// Tiles are handed out as shared_ptrs: a tile evicted while a thread still uses it stays
+// alive until that thread lets go of it. The per-thread tables hold a few dozen tiles
+// each, that is the only memory on top of the budget.
+
+const int texture_tile_size = 32;
+
+struct texture_tile {
+    float texels[texture_tile_size*texture_tile_size*3];
+};
+
+class texture_tile_cache {
+    public:
+        static texture_tile_cache& global() {
+            static texture_tile_cache cache;
+            return cache;
+        }
+
+        void set_budget(size_t bytes) {
+            size_t tiles = bytes / sizeof(texture_tile);
+            max_tiles_per_shard = std::max<size_t>(1, tiles / n_shards);
+        }
+
+        size_t budget() const {return max_tiles_per_shard*n_shards*sizeof(texture_tile);}
+
+        // Returns the cached tile for key, or calls load(tile&) to page it in
+        template <typename load_fn>
+        shared_ptr<const texture_tile> get(uint64_t key, load_fn&& load);
+
+    private:
+        texture_tile_cache() {set_budget(size_t(1024) << 20);}
+
+        struct entry {
+            uint64_t key;
+            shared_ptr<const texture_tile> tile;
+        };
+
+        struct shard {
+            std::mutex lock;
+            std::list<entry> lru;   // most recently used first
+            std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+        };
+
+        static const int n_shards = 16;
+        shard shards[n_shards];
+        size_t max_tiles_per_shard;
+};
+
+template <typename load_fn>
+shared_ptr<const texture_tile> texture_tile_cache::get(uint64_t key, load_fn&& load) {
+    auto& s = shards[(key ^ (key >> 29)) % n_shards];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            return it->second->tile;
+        }
+    }
+
+    // Read outside the lock; if two threads miss the same tile both read it, the
+    // first one to get back in wins
+    auto tile = make_shared<texture_tile>();
+    load(*tile);
+
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.index.find(key);
+    if (it != s.index.end()) return it->second->tile;
+
+    s.lru.push_front({key, tile});
+    s.index[key] = s.lru.begin();
+    while (s.lru.size() > max_tiles_per_shard) {
+        s.index.erase(s.lru.back().key);
+        s.lru.pop_back();
+    }
+    return tile;
+}
+
+class mip_tiled_image {
+    public:
+        // rgb is width*height texels, row by row from the top of the image
+        mip_tiled_image(const float* rgb, int _width, int _height);
+        ~mip_tiled_image() {if (file) fclose(file);}
+
+        mip_tiled_image(const mip_tiled_image&) = delete;
+        mip_tiled_image& operator=(const mip_tiled_image&) = delete;
+
+        int level_count() const {return static_cast<int>(levels.size());}
+        int width(int level = 0) const {return levels[level].width;}
+        int height(int level = 0) const {return levels[level].height;}
+
+        // Coordinates are clamped to the edge of the level
+        color texel(int level, int x, int y) const;
+
+        // s, t in texels of the given level, texel centers at +0.5
+        color bilinear(int level, double s, double t) const;
+
+        // u, v in [0, 1] from the top left, lod 0 is full resolution
+        color trilinear(double u, double v, double lod) const;
+
+    private:
+        struct level_info {
+            int width, height;
+            int tiles_x, tiles_y;
+            long file_offset;
+        };
+
+        const texture_tile& tile(int level, int tx, int ty) const;
+        void write_level(const std::vector<float>& rgb, level_info& info);
+
+    private:
+        uint32_t id;
+        std::vector<level_info> levels;
+        FILE* file = nullptr;
+};
+
+inline uint32_t next_texture_id() {
+    static std::atomic<uint32_t> counter{0};
+    return counter++;
+}
+
+mip_tiled_image::mip_tiled_image(const float* rgb, int _width, int _height) : id(next_texture_id()) {
+    file = tmpfile();
+    if (!file) {
+        std::cerr << "ERROR: Couldn't create a tile file for a texture.\n";
+        exit(1);
+    }
+
+    // Level 0 is the image itself, every further level halves it with a 2x2 box filter
+    // (the last row/column is repeated for odd sizes) down to a single texel
+    std::vector<float> current(rgb, rgb + 3*static_cast<size_t>(_width)*_height);
+    int w = _width, h = _height;
+    while (true) {
+        level_info info;
+        info.width = w;
+        info.height = h;
+        write_level(current, info);
+        levels.push_back(info);
+        if (w == 1 && h == 1) break;
+
+        int nw = std::max(1, w/2), nh = std::max(1, h/2);
+        std::vector<float> next(3*static_cast<size_t>(nw)*nh);
+        for (int y = 0; y < nh; y++) {
+            for (int x = 0; x < nw; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float sum = 0;
+                    for (int dy = 0; dy < 2; dy++)
+                        for (int dx = 0; dx < 2; dx++) {
+                            int sx = std::min(w-1, 2*x+dx), sy = std::min(h-1, 2*y+dy);
+                            sum += current[3*(static_cast<size_t>(sy)*w+sx)+c];
+                        }
+                    next[3*(static_cast<size_t>(y)*nw+x)+c] = 0.25f*sum;
+                }
+            }
+        }
+        current.swap(next);
+        w = nw;
+        h = nh;
+    }
+
+    if (fflush(file) != 0) {
+        std::cerr << "ERROR: Couldn't write a texture's tile file.\n";
+        exit(1);
+    }
+}
+
+void mip_tiled_image::write_level(const std::vector<float>& rgb, level_info& info) {
+    info.tiles_x = (info.width+texture_tile_size-1) / texture_tile_size;
+    info.tiles_y = (info.height+texture_tile_size-1) / texture_tile_size;
+    info.file_offset = ftell(file);
+
+    // Edge tiles are padded by repeating the last texel
+    texture_tile t;
+    for (int ty = 0; ty < info.tiles_y; ty++) {
+        for (int tx = 0; tx < info.tiles_x; tx++) {
+            for (int y = 0; y < texture_tile_size; y++) {
+                int sy = std::min(info.height-1, ty*texture_tile_size+y);
+                for (int x = 0; x < texture_tile_size; x++) {
+                    int sx = std::min(info.width-1, tx*texture_tile_size+x);
+                    const float* src = &rgb[3*(static_cast<size_t>(sy)*info.width+sx)];
+                    float* dst = &t.texels[3*(y*texture_tile_size+x)];
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                }
+            }
+            if (fwrite(&t, sizeof(t), 1, file) != 1) {
+                std::cerr << "ERROR: Couldn't write a texture's tile file.\n";
+                exit(1);
+            }
+        }
+    }
+}
+
+const texture_tile& mip_tiled_image::tile(int level, int tx, int ty) const {
+    const auto& info = levels[level];
+    const auto tile_index = static_cast<uint32_t>(ty*info.tiles_x + tx);
+    const uint64_t key = (uint64_t(id) << 40) | (uint64_t(level) << 32) | tile_index;
+
+    // Per-thread table of recently used tiles, the shared_ptrs keep them alive
+    const int local_slots = 64;
+    struct local_slot {
+        uint64_t key = ~uint64_t(0);
+        shared_ptr<const texture_tile> tile;
+    };
+    thread_local local_slot local[local_slots];
+
+    auto& slot = local[(key * 0x9e3779b97f4a7c15ULL) >> 58];
+    if (slot.key != key || !slot.tile) {
+        slot.tile = texture_tile_cache::global().get(key, [&](texture_tile& out) {
+            const long offset = info.file_offset + static_cast<long>(tile_index)*static_cast<long>(sizeof(texture_tile));
+            if (pread(fileno(file), &out, sizeof(out), offset) != static_cast<ssize_t>(sizeof(out))) {
+                std::cerr << "ERROR: Couldn't read a texture tile.\n";
+                exit(1);
+            }
+        });
+        slot.key = key;
+    }
+    return *slot.tile;
+}
+
+color mip_tiled_image::texel(int level, int x, int y) const {
+    const auto& info = levels[level];
+    x = std::min(std::max(x, 0), info.width-1);
+    y = std::min(std::max(y, 0), info.height-1);
+
+    const auto& t = tile(level, x / texture_tile_size, y / texture_tile_size);
+    const float* p = &t.texels[3*((y % texture_tile_size)*texture_tile_size + x % texture_tile_size)];
+    return color(p[0], p[1], p[2]);
+}
+
+color mip_tiled_image::bilinear(int level, double s, double t) const {
+    s -= 0.5;
+    t -= 0.5;
+    const double fs = floor(s), ft = floor(t);
+    const int x = static_cast<int>(fs), y = static_cast<int>(ft);
+    const double ds = s-fs, dt = t-ft;
+
+    return (1-ds)*(1-dt)*texel(level, x, y) + ds*(1-dt)*texel(level, x+1, y)
+         + (1-ds)*dt*texel(level, x, y+1) + ds*dt*texel(level, x+1, y+1);
+}
+
+color mip_tiled_image::trilinear(double u, double v, double lod) const {
+    lod = clamp(lod, 0.0, static_cast<double>(level_count()-1));
+    const int l0 = static_cast<int>(lod);
+    const int l1 = std::min(l0+1, level_count()-1);
+    const double f = lod - l0;
+
+    color c0 = bilinear(l0, u*width(l0), v*height(l0));
+    if (f == 0 || l1 == l0) return c0;
+    return (1-f)*c0 + f*bilinear(l1, u*width(l1), v*height(l1));
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Splits the image into square tiles and hands them out to worker threads.
+// Tiles are ordered along a Morton (Z-order) curve, so consecutive tiles are close
+// on screen and their camera rays tend to touch the same BVH nodes. Every worker
+// starts out owning a contiguous run of that order and takes tiles from its front.
+// A worker that runs dry steals from the back of another worker's run, so a few
+// expensive rows (glass, fog, ...) don't leave the other cores idle at the end.
+// All queue operations are single compare-and-swaps, no locks are taken.
+
+struct tile {
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+};
+
+inline uint32_t morton_spread_bits(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+inline uint32_t morton_code(uint32_t x, uint32_t y) {
+    return morton_spread_bits(x) | (morton_spread_bits(y) << 1);
+}
+
+class tile_scheduler {
+    public:
+        tile_scheduler(int width, int height, int tile_size, int n_workers);
+
+        // Fetches the next tile for worker, stealing if its own run is empty.
+        // Returns false once every tile has been handed out.
+        bool next_tile(int worker, tile& out);
+
+        // Marks a tile as finished and returns the number of finished tiles.
+        int finish_tile() {return ++finished;}
+
+        int tile_count() const {return static_cast<int>(tiles.size());}
+
+    private:
+        // [head, tail) packed into one word: head in the low half, tail in the high half
+        struct alignas(64) tile_range {
+            std::atomic<uint64_t> bounds;
+        };
+
+        static uint64_t pack(uint32_t head, uint32_t tail) {return (uint64_t(tail) << 32) | head;}
+        static uint32_t head_of(uint64_t b) {return static_cast<uint32_t>(b);}
+        static uint32_t tail_of(uint64_t b) {return static_cast<uint32_t>(b >> 32);}
+
+        bool pop_front(int worker, uint32_t& index);
+        bool pop_back(int worker, uint32_t& index);
+
+    private:
+        std::vector<tile> tiles;
+        int workers;
+        std::unique_ptr<tile_range[]> ranges;
+        std::atomic<int> finished{0};
+};
+
+tile_scheduler::tile_scheduler(int width, int height, int tile_size, int n_workers)
+    : workers(std::max(1, n_workers)), ranges(new tile_range[std::max(1, n_workers)])
+{
+    tile_size = std::max(1, tile_size);
+    int tiles_x = (width+tile_size-1) / tile_size;
+    int tiles_y = (height+tile_size-1) / tile_size;
+
+    std::vector<std::pair<uint32_t, tile>> ordered;
+    ordered.reserve(static_cast<size_t>(tiles_x)*tiles_y);
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tile t;
+            t.x0 = tx*tile_size;
+            t.y0 = ty*tile_size;
+            t.x1 = std::min(width, t.x0+tile_size);
+            t.y1 = std::min(height, t.y0+tile_size);
+            ordered.push_back({morton_code(tx, ty), t});
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(),
+        [](const std::pair<uint32_t, tile>& a, const std::pair<uint32_t, tile>& b) {return a.first < b.first;});
+
+    tiles.reserve(ordered.size());
+    for (const auto& entry : ordered) tiles.push_back(entry.second);
+
+    const auto n = static_cast<uint32_t>(tiles.size());
+    for (int w = 0; w < workers; w++) {
+        uint32_t head = static_cast<uint32_t>(uint64_t(n)*w/workers);
+        uint32_t tail = static_cast<uint32_t>(uint64_t(n)*(w+1)/workers);
+        ranges[w].bounds.store(pack(head, tail));
+    }
+}
+
+bool tile_scheduler::pop_front(int worker, uint32_t& index) {
+    auto& bounds = ranges[worker].bounds;
+    uint64_t b = bounds.load(std::memory_order_relaxed);
+    while (head_of(b) < tail_of(b)) {
+        if (bounds.compare_exchange_weak(b, pack(head_of(b)+1, tail_of(b)))) {
+            index = head_of(b);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool tile_scheduler::pop_back(int worker, uint32_t& index) {
+    auto& bounds = ranges[worker].bounds;
+    uint64_t b = bounds.load(std::memory_order_relaxed);
+    while (head_of(b) < tail_of(b)) {
+        if (bounds.compare_exchange_weak(b, pack(head_of(b), tail_of(b)-1))) {
+            index = tail_of(b)-1;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool tile_scheduler::next_tile(int worker, tile& out) {
+    uint32_t index;
+    worker %= workers;
+
+    if (pop_front(worker, index)) {
+        out = tiles[index];
+        return true;
+    }
+
+    for (int k = 1; k < workers; k++) {
+        if (pop_back((worker+k) % workers, index)) {
+            out = tiles[index];
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -4,14 +4,15 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
+// Threshold on the determinant for rays (nearly) parallel to the triangle. Kept the
+// same for float vec3s, it is well above their rounding noise for sane triangles.
 #define EPS 0.000001
 
 class triangle: public hittable {
     public:
         triangle() {}
-        triangle(const vec3 v0, const vec3 v1, const vec3 v2, shared_ptr<material> m) {
-            triangle(v0, v1, v2, vec3(), vec3(), vec3(), false, m);
-        }
+        triangle(const vec3 v0, const vec3 v1, const vec3 v2, shared_ptr<material> m):
+            triangle(v0, v1, v2, vec3(), vec3(), vec3(), false, m) {}
         triangle(const vec3 v0, const vec3 v1, const vec3 v2, const vec3 vn0, const vec3 vn1, const vec3 vn2, bool smooth_shading, shared_ptr<material> m): mat_ptr(m) {
             verts[0] = v0; 
             verts[1] = v1; 
@@ -25,48 +26,61 @@ class triangle: public hittable {
             middle_normal = unit_vector(cross(v0-v1, v0-v2));
         }
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double t, u, v, det;
+            return intersect(r, t_min, t_max, t, u, v, det);
+        }
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
         virtual double pdf_value(const point3& o, const vec3& v) const override;
         virtual vec3 random(const vec3& o) const override;
+        virtual double surface_area() const override {return area;}
     public:
         vec3 verts[3];
         shared_ptr<material> mat_ptr;
         vec3 vert_normals[3];
         bool smooth_normals;
+    private:
+        bool intersect(const ray& r, double t_min, double t_max, double& t, double& u, double& v, double& det) const;
+
     private:
         double area;
         vec3 middle_normal;
 };
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool triangle::intersect(const ray& r, double t_min, double t_max, double& t, double& u, double& v, double& det) const {
     // MT algorithm, https://web.archive.org/web/20200927071045/https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
     auto v0_v1 = verts[1] - verts[0];
     auto v0_v2 = verts[2] - verts[0];
     auto dir = r.direction();
     auto parallel_vec = cross(dir, v0_v2);
-    auto det = dot(v0_v1, parallel_vec);
+    det = dot(v0_v1, parallel_vec);
     // If det < 0, this is a back-facing intersection, change hit_record front_face
     // ray and triangle are parallel if det is close to 0
     if (fabs(det) < EPS) return false;
     auto inv_det = 1. / det;
 
     auto tvec = r.origin() - verts[0];
-    auto u = dot(tvec, parallel_vec)*inv_det;
+    u = dot(tvec, parallel_vec)*inv_det;
     if (u < 0 || u > 1) return false;
 
     auto qvec = cross(tvec, v0_v1);
-    auto v = dot(dir, qvec)*inv_det;
+    v = dot(dir, qvec)*inv_det;
     if (v < 0 || u + v > 1) return false;
 
-    double t = dot(v0_v2, qvec)*inv_det;
+    t = dot(v0_v2, qvec)*inv_det;
+
+    return !(t < t_min || t > t_max);
+}
+
+bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, u, v, det;
+    if (!intersect(r, t_min, t_max, t, u, v, det)) return false;
 
-    if (t < t_min || t > t_max) return false;
-    
     rec.t = t;
     rec.u = u;
     rec.v = v;
     rec.p = r.at(t);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     rec.front_face = true;
     vec3 normal = middle_normal;
@@ -90,19 +104,15 @@ bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
 }
 
 double triangle::pdf_value(const point3& o, const vec3& v) const {
-    hit_record rec;
-    if (!this->hit(ray(o, v), EPS, infinity, rec))
+    double t, u, w, det;
+    if (!intersect(ray(o, v), ray_epsilon, infinity, t, u, w, det))
         return 0;
 
-    // from https://ieeexplore.ieee.org/stamp/stamp.jsp?tp=&arnumber=4121581
-    vec3 R1 = verts[0]-o, R2=verts[1]-o, R3=verts[2]-o;
-    double r1=R1.length(), r2=R2.length(), r3=R3.length();
-    double N = dot(R1, cross(R2, R3));
-    double D = r1*r2*r3 + dot(R1, R2)*r3 + dot(R1, R3)*r2 + dot(R2, R3)*r3;
-
-    double omega = atan2(N, D);
+    // random() picks points uniformly by area, so this is the area pdf seen from o
+    auto distance_squared = t*t*v.length_squared();
+    auto cosine = fabs(dot(v, middle_normal) / v.length());
 
-    return 1./omega;
+    return distance_squared/(cosine*area);
 }
 
 vec3 triangle::random(const point3& o) const {
@@ -0,0 +1,271 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <vector>
+
+// Read-only view of an array, which may live in a std::vector or in a mapped file.
+template <typename T>
+struct array_view {
+    const T* ptr = nullptr;
+    size_t count = 0;
+
+    array_view() {}
+    array_view(const std::vector<T>& v): ptr(v.data()), count(v.size()) {}
+    array_view(const T* p, size_t n): ptr(p), count(n) {}
+
+    const T& operator[](size_t i) const {return ptr[i];}
+    const T* data() const {return ptr;}
+    size_t size() const {return count;}
+    bool empty() const {return count == 0;}
+};
+
+// Everything a mesh is made of, filled in by the loader. Indices are 3 per face; positions,
+// normals and uvs are indexed separately, like in an OBJ file.
+struct mesh_buffers {
+    std::vector<float> positions;           // xyz per vertex
+    std::vector<float> normals;             // xyz, unit length
+    std::vector<float> uvs;                 // uv
+    std::vector<uint32_t> vertex_indices;
+    std::vector<uint32_t> normal_indices;   // empty, or no_index for flat faces
+    std::vector<uint32_t> uv_indices;       // empty, or no_index for faces without uvs
+    std::vector<uint16_t> material_ids;     // 1 per face
+    std::vector<bvh4_node> nodes;           // filled in by triangle_mesh
+};
+
+// Indexed triangle mesh. Vertex attributes live in shared float buffers and faces are
+// just 32-bit indices into them, plus a material id, so a face costs a few dozen bytes
+// instead of a heap allocated triangle with its own vertices, normals and shared_ptr.
+// The mesh has its own 4-wide BVH over its faces.
+//
+// Faces without normals (or all of them, if normal_indices is empty) are flat shaded,
+// faces without uvs get their barycentric coordinates as u, v like triangle does.
+// The mesh only reads its data through views, so it can be used straight from a mapped
+// cache file (see mesh_cache.h) as well as from buffers it owns.
+class triangle_mesh: public hittable {
+    public:
+        static const uint32_t no_index = 0xffffffff;
+        static const size_t max_leaf_size = 4;
+
+        // Reorders the faces for the BVH and builds it
+        triangle_mesh(mesh_buffers _buffers, std::vector<shared_ptr<material>> _materials);
+        // For data that is already in BVH order, nodes included. The caller points the views
+        // into backing, which lives as long as the mesh.
+        triangle_mesh(shared_ptr<const void> _backing, std::vector<shared_ptr<material>> _materials)
+            : materials(std::move(_materials)), backing(std::move(_backing)) {}
+        // The views may point into buffers, so a copy would dangle
+        triangle_mesh(const triangle_mesh&) = delete;
+        triangle_mesh& operator=(const triangle_mesh&) = delete;
+
+        size_t face_count() const {return material_ids.size();}
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = box;
+            return !nodes.empty();
+        }
+
+        virtual double surface_area() const override;
+
+        size_t memory_usage() const;
+
+    public:
+        array_view<float> positions;
+        array_view<float> normals;
+        array_view<float> uvs;
+        array_view<uint32_t> vertex_indices;
+        array_view<uint32_t> normal_indices;
+        array_view<uint32_t> uv_indices;
+        array_view<uint16_t> material_ids;
+        array_view<bvh4_node> nodes;
+
+        std::vector<shared_ptr<material>> materials;
+        aabb box;
+        bvh_build_stats build_stats;
+
+    private:
+        point3 position(uint32_t i) const {
+            return point3(positions[3*i], positions[3*i+1], positions[3*i+2]);
+        }
+
+        bool intersect_face(size_t face, const ray& r, double t_min, double t_max,
+                double& t, double& u, double& v, double& det) const;
+        bool hit_face(size_t face, const ray& r, double t_min, double t_max, hit_record& rec) const;
+
+    private:
+        // Owned data, empty if the views point into a mapped file
+        mesh_buffers buffers;
+        shared_ptr<const void> backing;
+};
+
+triangle_mesh::triangle_mesh(mesh_buffers _buffers, std::vector<shared_ptr<material>> _materials)
+    : materials(std::move(_materials)), buffers(std::move(_buffers))
+{
+    auto& b = buffers;
+    const size_t n_faces = b.material_ids.size();
+    if (n_faces == 0) {
+        std::cerr << "Empty triangle_mesh.\n";
+        return;
+    }
+
+    std::vector<bvh_primitive_info> infos(n_faces);
+    const vec3 pad(box_padding, box_padding, box_padding);
+    auto pos = [&](uint32_t i) {return point3(b.positions[3*i], b.positions[3*i+1], b.positions[3*i+2]);};
+    const auto n_faces_l = static_cast<long>(n_faces);
+    #pragma omp parallel for schedule(static) if(n_faces >= bvh_builder::parallel_grain)
+    for (long fl = 0; fl < n_faces_l; fl++) {
+        const auto f = static_cast<size_t>(fl);
+        auto v0 = pos(b.vertex_indices[3*f]);
+        auto v1 = pos(b.vertex_indices[3*f+1]);
+        auto v2 = pos(b.vertex_indices[3*f+2]);
+        infos[f].index = f;
+        infos[f].box = aabb(min(min(v0, v1), v2)-pad, max(max(v0, v1), v2)+pad);
+        infos[f].centroid = 0.5*(infos[f].box.min()+infos[f].box.max());
+    }
+
+    bvh_builder builder(std::move(infos), max_leaf_size);
+
+    // Put the faces in BVH order, so a leaf is a contiguous range of faces
+    auto reorder = [&](std::vector<uint32_t>& per_corner) {
+        if (per_corner.empty()) return;
+        std::vector<uint32_t> sorted(per_corner.size());
+        for (size_t f = 0; f < n_faces; f++)
+            for (size_t k = 0; k < 3; k++)
+                sorted[3*f+k] = per_corner[3*builder.prims[f].index+k];
+        per_corner.swap(sorted);
+    };
+    reorder(b.vertex_indices);
+    reorder(b.normal_indices);
+    reorder(b.uv_indices);
+
+    std::vector<uint16_t> sorted_ids(n_faces);
+    for (size_t f = 0; f < n_faces; f++) sorted_ids[f] = b.material_ids[builder.prims[f].index];
+    b.material_ids.swap(sorted_ids);
+
+    b.nodes = collapse_bvh4(builder);
+    box = builder.nodes[0].box;
+    build_stats = builder.stats;
+
+    positions = b.positions;
+    normals = b.normals;
+    uvs = b.uvs;
+    vertex_indices = b.vertex_indices;
+    normal_indices = b.normal_indices;
+    uv_indices = b.uv_indices;
+    material_ids = b.material_ids;
+    nodes = b.nodes;
+}
+
+bool triangle_mesh::intersect_face(size_t face, const ray& r, double t_min, double t_max,
+        double& t, double& u, double& v, double& det) const {
+    // Same Moller-Trumbore test as triangle::hit
+    const uint32_t* vi = &vertex_indices[3*face];
+    auto v0 = position(vi[0]);
+    auto v0_v1 = position(vi[1]) - v0;
+    auto v0_v2 = position(vi[2]) - v0;
+    const auto& dir = r.dir;
+    auto parallel_vec = cross(dir, v0_v2);
+    det = dot(v0_v1, parallel_vec);
+    if (fabs(det) < EPS) return false;
+    auto inv_det = 1. / det;
+
+    auto tvec = r.orig - v0;
+    u = dot(tvec, parallel_vec)*inv_det;
+    if (u < 0 || u > 1) return false;
+
+    auto qvec = cross(tvec, v0_v1);
+    v = dot(dir, qvec)*inv_det;
+    if (v < 0 || u + v > 1) return false;
+
+    t = dot(v0_v2, qvec)*inv_det;
+    return !(t < t_min || t > t_max);
+}
+
+bool triangle_mesh::hit_face(size_t face, const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, u, v, det;
+    if (!intersect_face(face, r, t_min, t_max, t, u, v, det)) return false;
+
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.mat_ptr = materials[material_ids[face]].get();
+
+    rec.u = u;
+    rec.v = v;
+    if (!uv_indices.empty() && uv_indices[3*face] != no_index) {
+        const uint32_t* ti = &uv_indices[3*face];
+        double w = 1-u-v;
+        rec.u = w*uvs[2*ti[0]] + u*uvs[2*ti[1]] + v*uvs[2*ti[2]];
+        rec.v = w*uvs[2*ti[0]+1] + u*uvs[2*ti[1]+1] + v*uvs[2*ti[2]+1];
+    }
+
+    vec3 normal;
+    if (!normal_indices.empty() && normal_indices[3*face] != no_index) {
+        const uint32_t* ni = &normal_indices[3*face];
+        auto normal_at = [&](uint32_t i) {return vec3(normals[3*i], normals[3*i+1], normals[3*i+2]);};
+        normal = (1-u-v)*normal_at(ni[0]) + u*normal_at(ni[1]) + v*normal_at(ni[2]);
+    } else {
+        const uint32_t* vi = &vertex_indices[3*face];
+        auto v0 = position(vi[0]);
+        normal = unit_vector(cross(position(vi[1]) - v0, position(vi[2]) - v0));
+    }
+
+    rec.front_face = true;
+    rec.set_face_normal(r, (det>=-EPS)? normal:-normal);
+    return true;
+}
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty()) return false;
+
+    return traverse_bvh4(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double& closest) {
+            bool hit_leaf = false;
+            for (int f = first; f < first+count; f++) {
+                if (hit_face(static_cast<size_t>(f), r, t_min, closest, rec)) {
+                    hit_leaf = true;
+                    closest = rec.t;
+                }
+            }
+            return hit_leaf;
+        });
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const {
+    if (nodes.empty()) return false;
+
+    return traverse_bvh4<true>(nodes.data(), r, t_min, t_max,
+        [&](int first, int count, double&) {
+            double t, u, v, det;
+            for (int f = first; f < first+count; f++)
+                if (intersect_face(static_cast<size_t>(f), r, t_min, t_max, t, u, v, det)) return true;
+            return false;
+        });
+}
+
+double triangle_mesh::surface_area() const {
+    double area = 0;
+    for (size_t f = 0; f < face_count(); f++) {
+        const uint32_t* vi = &vertex_indices[3*f];
+        auto v0 = position(vi[0]);
+        area += 0.5*cross(position(vi[1]) - v0, position(vi[2]) - v0).length();
+    }
+    return area;
+}
+
+size_t triangle_mesh::memory_usage() const {
+    return positions.size()*sizeof(float) + normals.size()*sizeof(float) + uvs.size()*sizeof(float)
+        + (vertex_indices.size() + normal_indices.size() + uv_indices.size())*sizeof(uint32_t)
+        + material_ids.size()*sizeof(uint16_t) + nodes.size()*sizeof(bvh4_node);
+}
+
+#endif
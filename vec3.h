@@ -7,30 +7,46 @@
 
 using std::sqrt;
 
-class vec3 {
+// vec3 stores vec3_real (double, or float with -DRTW_VEC3_FLOAT, see rtweekend.h).
+// With -DRTW_VEC3_SIMD it is padded to 4 lanes and aligned to its size, so the
+// element-wise operators below compile to single SSE (float) or AVX (double)
+// instructions. The padding lane is kept at 0. The interface is double either way.
+#ifdef RTW_VEC3_SIMD
+#define VEC3_LANES 4
+#define VEC3_ALIGN alignas(4*sizeof(vec3_real))
+#else
+#define VEC3_LANES 3
+#define VEC3_ALIGN
+#endif
+
+class VEC3_ALIGN vec3 {
     public:
+        static const int lanes = VEC3_LANES;
+
         vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        vec3(double e0, double e1, double e2)
+            : e{static_cast<vec3_real>(e0), static_cast<vec3_real>(e1), static_cast<vec3_real>(e2)} {}
 
         double x() const { return e[0]; }
         double y() const { return e[1]; }
         double z() const { return e[2]; }
 
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+        vec3 operator-() const {
+            vec3 r;
+            for (int i = 0; i < lanes; i++) r.e[i] = -e[i];
+            return r;
+        }
         double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        vec3_real& operator[](int i) { return e[i]; }
 
         vec3& operator+=(const vec3 &v) {
-            e[0] += v.e[0];
-            e[1] += v.e[1];
-            e[2] += v.e[2];
+            for (int i = 0; i < lanes; i++) e[i] += v.e[i];
             return *this;
         }
 
         vec3& operator*=(const double t) {
-            e[0] *= t;
-            e[1] *= t;
-            e[2] *= t;
+            const auto s = static_cast<vec3_real>(t);
+            for (int i = 0; i < lanes; i++) e[i] *= s;
             return *this;
         }
 
@@ -43,7 +59,7 @@ class vec3 {
         }
 
         double length_squared() const {
-            return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
+            return double(e[0])*e[0] + double(e[1])*e[1] + double(e[2])*e[2];
         }
 
         inline static vec3 random(){
@@ -60,7 +76,7 @@ class vec3 {
         }
 
     public:
-        double e[3];
+        vec3_real e[VEC3_LANES];
 };
 
 // Type aliases for vec3
@@ -75,19 +91,28 @@ inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
 }
 
 inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = u.e[i] + v.e[i];
+    return r;
 }
 
 inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = u.e[i] - v.e[i];
+    return r;
 }
 
 inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = u.e[i] * v.e[i];
+    return r;
 }
 
 inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+    const auto s = static_cast<vec3_real>(t);
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = s * v.e[i];
+    return r;
 }
 
 inline vec3 operator*(const vec3 &v, double t) {
@@ -99,17 +124,22 @@ inline vec3 operator/(vec3 v, double t) {
 }
 
 inline vec3 max(const vec3& v, const vec3& u){
-    return vec3(std::max(v.e[0], u.e[0]), std::max(v.e[1], u.e[1]), std::max(v.e[2], u.e[2]));
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = std::max(v.e[i], u.e[i]);
+    return r;
 }
 
 inline vec3 min(const vec3& v, const vec3& u){
-    return vec3(std::min(v.e[0], u.e[0]), std::min(v.e[1], u.e[1]), std::min(v.e[2], u.e[2]));
+    vec3 r;
+    for (int i = 0; i < vec3::lanes; i++) r.e[i] = std::min(v.e[i], u.e[i]);
+    return r;
 }
 
+// Accumulates in double, so float storage doesn't lose precision in the sum
 inline double dot(const vec3 &u, const vec3 &v) {
-    return u.e[0] * v.e[0]
-         + u.e[1] * v.e[1]
-         + u.e[2] * v.e[2];
+    return double(u.e[0]) * v.e[0]
+         + double(u.e[1]) * v.e[1]
+         + double(u.e[2]) * v.e[2];
 }
 
 inline vec3 cross(const vec3 &u, const vec3 &v) {
@@ -0,0 +1,311 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "texture.h"
+#include "progressive.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <typeinfo>
+#include <vector>
+
+// Wavefront path tracing: instead of following one path at a time through ray_color, a
+// whole wave of paths (many pixels' worth of samples) advances one bounce at a time in
+// stages, each a parallel loop over a queue:
+//
+//   generate   camera rays for every sample of the wave
+//   intersect  all live rays against the world, sorted by direction octant and origin
+//              (Morton order) first so neighbouring rays walk the same BVH nodes
+//   shade      emission and scatter() of every hit, sorted by material type and instance
+//              so the same material code and textures run back to back
+//   sample     direction of every diffuse bounce from the light/BSDF/background mixture
+//
+// The paths themselves stay put, one per sample slot of the wave; the queue is a list of
+// their indices, and sorting and compaction only move those, not the paths with their
+// hit and scatter records. Paths that miss, stop scattering or run out of bounces drop
+// out of the queue.
+// The estimator is ray_color's (no russian roulette, emission of specular surfaces is
+// ignored the same way), so both converge to the same image; the random numbers differ.
+//
+// Every path reseeds the thread's RNG from its pixel, sample index, bounce and stage,
+// so the image depends neither on sorting nor on threads. Samples are numbered per pixel
+// from its estimate's count, so passes and resumed renders continue the same sequence.
+
+struct wavefront_job {
+    uint32_t pixel;     // index into the accumulation buffer
+    int samples;
+};
+
+// Path of one sample slot, its radiance goes to slot_radiance at the same index
+struct wavefront_path {
+    ray r;
+    color throughput;
+    hit_record rec;
+    scatter_record srec;
+};
+
+// Paths per wave, a few hundred bytes each
+const size_t wavefront_default_wave_size = 1 << 16;
+
+class wavefront_renderer {
+    public:
+        wavefront_renderer(const camera& _cam, int _width, int _height,
+                const shared_ptr<texture>& _background, const shared_ptr<pdf>& _background_pdf,
+                const hittable& _world, const shared_ptr<hittable>& _lights,
+                int _max_depth, uint64_t _seed, int _threads, size_t _wave_size = wavefront_default_wave_size)
+            : cam(_cam), width(_width), height(_height), background(_background), background_pdf(_background_pdf),
+              world(_world), lights(_lights), max_depth(_max_depth), seed(_seed), threads(_threads),
+              wave_size(std::max<size_t>(1, _wave_size)) {
+            aabb box;
+            has_bounds = world.bounding_box(0, 1, box);
+            if (has_bounds) {
+                bounds_min = box.min();
+                bounds_extent = box.max()-box.min();
+            }
+        }
+
+        // Adds the samples of every job to accum, a wave of whole jobs at a time. Stops
+        // after the wave in flight once stop is set; returns how many jobs were done.
+        size_t render(const std::vector<wavefront_job>& jobs, accumulation_buffer& accum,
+                const volatile std::sig_atomic_t& stop) const;
+
+    private:
+        enum stage {stage_generate, stage_shade, stage_sample};
+
+        // Seeds the thread's RNG for one stage of one path
+        void seed_path(uint32_t slot, int bounce, stage s) const {
+            seed_random(hash_seed(slot_seeds[slot], static_cast<uint64_t>(bounce), s));
+        }
+
+        uint32_t ray_key(const ray& r) const;
+        // Reorder the queue of path indices, the paths don't move
+        void sort_by_ray(const std::vector<wavefront_path>& paths, std::vector<uint32_t>& queue) const;
+        void sort_by_material(const std::vector<wavefront_path>& paths, std::vector<uint32_t>& queue) const;
+        void trace_wave(std::vector<wavefront_path>& paths) const;
+
+    private:
+        camera cam;
+        int width, height;
+        const shared_ptr<texture>& background;
+        const shared_ptr<pdf>& background_pdf;
+        const hittable& world;
+        const shared_ptr<hittable>& lights;
+        int max_depth;
+        uint64_t seed;
+        int threads;
+        size_t wave_size;
+
+        bool has_bounds;
+        point3 bounds_min;
+        vec3 bounds_extent;
+
+        // Per sample slot of the current wave, only touched by the path in that slot
+        mutable std::vector<uint64_t> slot_seeds;
+        mutable std::vector<color> slot_radiance;
+};
+
+// Direction octant on top, then the Morton code of the origin within the world's box
+uint32_t wavefront_renderer::ray_key(const ray& r) const {
+    const vec3& d = r.direction();
+    uint32_t key = (d.x() < 0? 4u:0u) | (d.y() < 0? 2u:0u) | (d.z() < 0? 1u:0u);
+    key <<= 27;
+    if (has_bounds) {
+        uint32_t q[3];
+        for (int a = 0; a < 3; a++) {
+            double t = bounds_extent[a] > 0? (r.origin()[a]-bounds_min[a]) / bounds_extent[a] : 0;
+            q[a] = static_cast<uint32_t>(clamp(t, 0.0, 1.0)*511.0);
+        }
+        uint32_t morton = 0;
+        for (int bit = 8; bit >= 0; bit--)
+            for (int a = 0; a < 3; a++)
+                morton = (morton << 1) | ((q[a] >> bit) & 1u);
+        key |= morton;
+    }
+    return key;
+}
+
+void wavefront_renderer::sort_by_ray(const std::vector<wavefront_path>& paths,
+        std::vector<uint32_t>& queue) const {
+    const size_t n = queue.size();
+    std::vector<uint64_t> keys(n);
+    #pragma omp parallel for num_threads(threads) schedule(static)
+    for (size_t k = 0; k < n; k++)
+        keys[k] = (static_cast<uint64_t>(ray_key(paths[queue[k]].r)) << 32) | queue[k];
+    std::sort(keys.begin(), keys.end());
+
+    for (size_t k = 0; k < n; k++) queue[k] = static_cast<uint32_t>(keys[k] & 0xffffffffu);
+}
+
+void wavefront_renderer::sort_by_material(const std::vector<wavefront_path>& paths,
+        std::vector<uint32_t>& queue) const {
+    struct entry {
+        size_t type;
+        uintptr_t mat;
+        uint32_t index;
+    };
+    const size_t n = queue.size();
+    std::vector<entry> keys(n);
+    #pragma omp parallel for num_threads(threads) schedule(static)
+    for (size_t k = 0; k < n; k++) {
+        const material* mat = paths[queue[k]].rec.mat_ptr;
+        keys[k] = {typeid(*mat).hash_code(), reinterpret_cast<uintptr_t>(mat), queue[k]};
+    }
+    std::sort(keys.begin(), keys.end(), [](const entry& a, const entry& b) {
+        if (a.type != b.type) return a.type < b.type;
+        if (a.mat != b.mat) return a.mat < b.mat;
+        return a.index < b.index;
+    });
+
+    for (size_t k = 0; k < n; k++) queue[k] = keys[k].index;
+}
+
+void wavefront_renderer::trace_wave(std::vector<wavefront_path>& paths) const {
+    std::vector<uint32_t> queue(paths.size());
+    for (size_t k = 0; k < paths.size(); k++) queue[k] = static_cast<uint32_t>(k);
+    std::vector<uint8_t> alive;     // 0: done, 1: continues, 2: continues after a diffuse sample
+
+    for (int bounce = 0; bounce < max_depth && !queue.empty(); bounce++) {
+        // intersect: misses pick up the background and are done
+        sort_by_ray(paths, queue);
+        const size_t n = queue.size();
+        alive.assign(n, 0);
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 256)
+        for (size_t k = 0; k < n; k++) {
+            const uint32_t slot = queue[k];
+            auto& p = paths[slot];
+            if (world.hit(p.r, ray_epsilon, infinity, p.rec)) {
+                alive[k] = 1;
+                continue;
+            }
+            auto unit_dir = unit_vector(p.r.direction());
+            double u, v; get_spherical_uv(unit_dir, u, v);
+            slot_radiance[slot] += p.throughput * background->value(u, v, unit_dir);
+        }
+        size_t live = 0;
+        for (size_t k = 0; k < n; k++)
+            if (alive[k]) queue[live++] = queue[k];
+        queue.resize(live);
+
+        // shade: emission, and the scatter decision of every hit
+        sort_by_material(paths, queue);
+        alive.assign(live, 0);
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 256)
+        for (size_t k = 0; k < live; k++) {
+            const uint32_t slot = queue[k];
+            auto& p = paths[slot];
+            seed_path(slot, bounce, stage_shade);
+            const material* mat = p.rec.mat_ptr;
+            color emitted = mat->emitted(p.r, p.rec, p.rec.u, p.rec.v, p.rec.p);
+
+            if (!mat->scatter(p.r, p.rec, p.srec)) {
+                slot_radiance[slot] += p.throughput * emitted;
+                continue;
+            }
+            alive[k] = 1;
+            if (p.srec.is_specular) {
+                p.throughput = p.throughput * p.srec.attenuation;
+                p.r = p.srec.specular_ray;
+            } else {
+                slot_radiance[slot] += p.throughput * emitted;
+                alive[k] = 2;
+            }
+        }
+
+        // sample: diffuse bounces pick their direction from the same mixture as ray_color
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 256)
+        for (size_t k = 0; k < live; k++) {
+            if (alive[k] != 2) continue;
+            const uint32_t slot = queue[k];
+            auto& p = paths[slot];
+            seed_path(slot, bounce, stage_sample);
+
+            hittable_pdf light_pdf(*lights, p.rec.p);
+            mixture_pdf p_objs(light_pdf, p.srec.diffuse_pdf, 0.5);
+            mixture_pdf mix(p_objs, *background_pdf, 0.8);
+
+            ray scattered = ray(p.rec.p, mix.generate(), p.r.time());
+            auto pdf_val = mix.value(scattered.direction());
+            p.throughput = p.throughput * p.srec.attenuation
+                * (p.rec.mat_ptr->scattering_pdf(p.r, p.rec, scattered) / pdf_val);
+            p.r = scattered;
+        }
+
+        size_t next = 0;
+        for (size_t k = 0; k < live; k++)
+            if (alive[k]) queue[next++] = queue[k];
+        queue.resize(next);
+    }
+    // Whatever is left ran out of bounces and, like ray_color at depth 0, adds nothing
+}
+
+size_t wavefront_renderer::render(const std::vector<wavefront_job>& jobs, accumulation_buffer& accum,
+        const volatile std::sig_atomic_t& stop) const {
+    std::vector<wavefront_path> paths;
+    size_t done = 0;
+
+    while (done < jobs.size() && !stop) {
+        // A wave is whole jobs, at least one
+        size_t end = done, total = 0;
+        while (end < jobs.size() && (end == done || total + static_cast<size_t>(jobs[end].samples) <= wave_size))
+            total += static_cast<size_t>(jobs[end++].samples);
+
+        // generate
+        slot_seeds.resize(total);
+        slot_radiance.assign(total, color(0, 0, 0));
+        std::vector<size_t> first_slot(end-done+1, 0);
+        for (size_t j = done; j < end; j++)
+            first_slot[j-done+1] = first_slot[j-done] + static_cast<size_t>(jobs[j].samples);
+
+        paths.resize(total);
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 16)
+        for (size_t j = done; j < end; j++) {
+            const auto& job = jobs[j];
+            const int i = static_cast<int>(job.pixel % static_cast<uint32_t>(width));
+            const int row = static_cast<int>(job.pixel / static_cast<uint32_t>(width));
+            const int first_sample = accum.estimates[job.pixel].n;
+            for (int s = 0; s < job.samples; s++) {
+                const auto slot = static_cast<uint32_t>(first_slot[j-done] + static_cast<size_t>(s));
+                slot_seeds[slot] = hash_seed(seed, static_cast<uint64_t>(i), static_cast<uint64_t>(row),
+                                             static_cast<uint64_t>(first_sample + s));
+                seed_path(slot, 0, stage_generate);
+
+                auto u = (i+random_double()) / (width-1);
+                auto v = (row+random_double()) / (height-1);
+                auto& p = paths[slot];
+                p.r = cam.get_ray(u, v);
+                p.throughput = color(1, 1, 1);
+            }
+        }
+
+        trace_wave(paths);
+
+        // Samples go into the pixel in order, so the estimates don't depend on the sorting
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 16)
+        for (size_t j = done; j < end; j++) {
+            const auto& job = jobs[j];
+            auto& estimate = accum.estimates[job.pixel];
+            color sum(0, 0, 0);
+            for (int s = 0; s < job.samples; s++) {
+                color c = slot_radiance[first_slot[j-done] + static_cast<size_t>(s)];
+                zero_nan_vals(c);
+                sum += c;
+                estimate.add(c);
+            }
+            accum.add(job.pixel, sum);
+        }
+
+        std::cerr << "\rPixels remaining: " << jobs.size()-end << " " << std::flush;
+        done = end;
+    }
+    return done;
+}
+
+#endif